@@ -0,0 +1,575 @@
+// Micro-benchmarks for the parser, player, synths and game. Results are written
+// as JSON so they can be tracked from commit to commit, and progress goes to
+// stderr. Run from the repository root, optionally with a name filter:
+//
+//     ./wte-bench [results.json] [filter]
+//
+// The synthetic stress-test files loaded by the corpus benchmarks can also be
+// written out for use elsewhere:
+//
+//     ./wte-bench corpus <directory> [seed]
+//
+// Synth changes are checked against golden renders recorded before the change,
+// on the same machine. The check fails on any audible difference beyond the
+// fidelity thresholds, or on a throughput regression:
+//
+//     ./wte-bench golden record [directory]
+//     ./wte-bench golden check [directory]
+
+#include "cache.h"
+#include "fileio.h"
+#include "game.h"
+#include "midi.h"
+#include "midistream.h"
+#include "pack.h"
+#include "sound.h"
+
+#include "golden.h"
+#include "midigen.h"
+#include "smf.h"
+
+#include <tb/tb.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+struct BenchmarkResult
+{
+    std::string name;
+    std::string params;     // JSON object members
+    uint64_t iterations;
+    double ns_per_op;
+    double items_per_second;
+};
+
+// Each benchmark runs for at least this long after one warm-up call
+constexpr auto MIN_BENCHMARK_TIME = std::chrono::milliseconds(200);
+
+std::vector<BenchmarkResult> results;
+std::string_view filter;
+volatile uint64_t sink;
+
+// fn performs one operation and returns the number of items it processed
+template<typename Fn>
+void Run(std::string name, std::string params, Fn&& fn)
+{
+    if (name.find(filter) == std::string::npos)
+        return;
+
+    using Clock = std::chrono::steady_clock;
+    sink = fn();
+
+    uint64_t iterations = 0, items = 0;
+    Clock::duration elapsed;
+    Clock::time_point start = Clock::now();
+
+    do {
+        items += fn();
+        ++iterations;
+        elapsed = Clock::now() - start;
+    } while (elapsed < MIN_BENCHMARK_TIME);
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    results.push_back({
+        .name = name,
+        .params = params,
+        .iterations = iterations,
+        .ns_per_op = seconds * 1e9 / iterations,
+        .items_per_second = items / seconds
+    });
+
+    fprintf(stderr, "%-28s %-50s %14.0f ns/op %14.0f items/s\n", name.c_str(),
+        params.c_str(), results.back().ns_per_op, results.back().items_per_second);
+}
+
+auto ReadFile(const char* path) -> std::vector<uint8_t>
+{
+    std::vector<uint8_t> bytes;
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) return bytes;
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+
+    uint8_t buffer[4096];
+    for (size_t count; (count = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+        bytes.insert(bytes.end(), buffer, buffer + count);
+    return bytes;
+}
+
+auto Parse(std::span<const uint8_t> bytes) -> midi::MIDI
+{
+    FILE* file = OpenMemory(bytes);
+    tb::scoped_guard close_file = [file] { fclose(file); };
+
+    auto midi = midi::MIDI::FromStream(file);
+    if (midi.is_error()) {
+        fprintf(stderr, "Benchmark MIDI failed to parse: %s\n",
+            midi.get_error().What().data());
+        exit(EXIT_FAILURE);
+    }
+    return std::move(midi.get_mut_unchecked());
+}
+
+// Tracks of evenly spaced notes on a scale, with a tempo change every bar on
+// the first track
+auto MakeSMF(size_t track_count, size_t notes_per_track) -> std::vector<uint8_t>
+{
+    constexpr uint16_t TICKS_PER_QUARTER_NOTE = 480;
+    SMFBuilder smf(1, TICKS_PER_QUARTER_NOTE);
+
+    for (size_t track = 0; track < track_count; ++track) {
+        smf.BeginTrack();
+        uint8_t channel = track % 16;
+
+        for (size_t i = 0; i < notes_per_track; ++i) {
+            if (track == 0 && i % 4 == 0)
+                smf.Tempo(0, 400000 + (i / 4 % 8) * 25000);
+
+            auto note = static_cast<uint8_t>(36 + (i * 7 + track * 5) % 60);
+            smf.Channel(0, 0x90 | channel, note, 96);
+            smf.Channel(TICKS_PER_QUARTER_NOTE, 0x80 | channel, note, 0);
+        }
+
+        smf.EndTrack();
+    }
+
+    return smf.Finish();
+}
+
+void BenchmarkParser()
+{
+    std::vector<uint8_t> small = ReadFile("midis/example.mid");
+    if (!small.empty()) {
+        Run("midi/from_stream", "\"file\": \"example.mid\"", [&] {
+            sink = Parse(small).length;
+            return small.size();
+        });
+    }
+
+    std::vector<uint8_t> huge = MakeSMF(16, 65536);
+    Run("midi/from_stream", "\"file\": \"generated\", \"tracks\": 16, \"events\": 2097152",
+        [&] {
+            sink = Parse(huge).length;
+            return huge.size();
+        });
+}
+
+void BenchmarkPlayer()
+{
+    for (size_t track_count : { 1, 16, 128 }) {
+        midi::MIDI midi = Parse(MakeSMF(track_count, 131072 / track_count));
+        midi::Player player;
+
+        Run("player/advance", "\"tracks\": " + std::to_string(track_count), [&] {
+            player.SetMIDI(midi);
+            uint64_t events = 0;
+            while (player.TicksUntilNextEvent() && !player.Advance().is_error())
+                ++events;
+            return events;
+        });
+    }
+}
+
+void BenchmarkSynths()
+{
+    constexpr int SAMPLE_RATE = 48000;
+    const std::pair<std::string_view, Synth> synths[] {
+        { "default", DEFAULT_SYNTH }, { "string", STRING_SYNTH }, { "fm", FM_SYNTH },
+        { "organ", ORGAN_SYNTH }, { "analog", ANALOG_SYNTH }
+    };
+
+    std::vector<Sample> buffer(SAMPLE_BUFFER_SIZE);
+
+    for (auto& [synth_name, synth] : synths) {
+        for (int voices : { 1, 8, 32 }) {
+            for (size_t buffer_size : { 64, 512, 4096 }) {
+                Generator generator { .sample_rate = SAMPLE_RATE };
+                generator.strings.Allocate(SAMPLE_RATE);
+
+                // Live, so voices age with the clock their note times come from
+                // and each buffer renders them further into their sustain
+                midi::Player player(midi::PlayerMode::LIVE_PLAYBACK);
+                for (int i = 0; i < voices; ++i) {
+                    player.PlayEvent({
+                        .type = midi::EventType::NOTE_ON,
+                        .note_event = { .note = static_cast<uint8_t>(36 + i * 2),
+                                        .velocity = 100 }
+                    });
+                }
+
+                std::string params = "\"synth\": \"" + std::string(synth_name)
+                    + "\", \"voices\": " + std::to_string(voices)
+                    + ", \"buffer\": " + std::to_string(buffer_size);
+
+                Run("generator/generate_samples", params, [&] {
+                    return generator.GenerateSamples({ buffer.data(), buffer_size },
+                        buffer_size, player, 0, synth);
+                });
+            }
+        }
+    }
+}
+
+void BenchmarkGame()
+{
+    constexpr size_t EXERCISE_NOTES = 16384;
+
+    midi::MIDI midi = Parse(MakeSMF(1, EXERCISE_NOTES));
+    std::vector<uint8_t> notes;
+    midi.tracks[0].ToNoteSeries(notes);
+
+    Resources resources;
+    MIDIIndex index = resources.AddMIDI(std::move(midi));
+    resources.exercises.push_back({
+        .midi = index,
+        .type = ExerciseType::SINGLE_VOICE_TRANSCRIPTION,
+        .tonality = Tonality::MAJOR, .difficulty = Difficulty::EXPERT
+    });
+
+    // An exercise only begins once its cadence loads too
+    Game game(resources);
+    game.SetCadences(index, index);
+
+    Run("game/input_note", "\"notes\": " + std::to_string(EXERCISE_NOTES), [&] {
+        game.BeginNewExercise().ignore_error();
+        game.MIDIEnded();
+        game.MIDIEnded();
+
+        auto key = static_cast<uint8_t>(game.GetRequiredInputKey());
+        for (uint8_t note : notes)
+            game.InputNote(note + key);
+        return notes.size();
+    });
+}
+
+void BenchmarkExerciseManifest()
+{
+    constexpr size_t EXERCISE_COUNT = 2000;
+
+    char directory[] = "/tmp/wte-bench-XXXXXX";
+    if (mkdtemp(directory) == nullptr) return;
+
+    std::string midi_path = std::string(directory) + "/exercise.mid";
+    std::string manifest_path = std::string(directory) + "/exercises.txt";
+
+    tb::scoped_guard remove_files = [&] {
+        unlink(midi_path.c_str());
+        unlink(manifest_path.c_str());
+        rmdir(directory);
+    };
+
+    std::vector<uint8_t> midi = MakeSMF(1, 32);
+    FILE* file = fopen(midi_path.c_str(), "wb");
+    fwrite(midi.data(), 1, midi.size(), file);
+    fclose(file);
+
+    file = fopen(manifest_path.c_str(), "w");
+    for (size_t i = 0; i < EXERCISE_COUNT; ++i) {
+        fprintf(file, "%s\n    single_voice_transcription\n    %s\n    easy\n\n",
+            midi_path.c_str(), i % 2 ? "minor" : "major");
+    }
+    fclose(file);
+
+    Run("resources/load_exercises", "\"exercises\": " + std::to_string(EXERCISE_COUNT),
+        [&] {
+            Resources resources;
+            resources.LoadExercises(manifest_path).ignore_error();
+            return resources.exercises.size();
+        });
+}
+
+void BenchmarkCorpus()
+{
+    for (const CorpusProfile& profile : CORPUS_PROFILES) {
+        std::vector<uint8_t> bytes = GenerateSMF(profile.options);
+        std::string params = "\"profile\": \"" + std::string(profile.name)
+            + "\", \"bytes\": " + std::to_string(bytes.size());
+
+        Run("corpus/load", params, [&] {
+            sink = Parse(bytes).length;
+            return bytes.size();
+        });
+
+        midi::MIDI midi = Parse(bytes);
+        midi::Player player;
+
+        Run("corpus/play", params, [&] {
+            player.SetMIDI(midi);
+            uint64_t events = 0;
+            while (player.TicksUntilNextEvent() && !player.Advance().is_error())
+                ++events;
+            return events;
+        });
+    }
+}
+
+// Warm loads from the parsed-MIDI cache against parsing the same file
+void BenchmarkMIDICache()
+{
+    char directory[] = "/tmp/wte-bench-XXXXXX";
+    if (mkdtemp(directory) == nullptr) return;
+
+    std::string midi_path = std::string(directory) + "/million_events.mid";
+    std::string cache_directory = std::string(directory) + "/cache";
+
+    tb::scoped_guard remove_files = [&] {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    };
+
+    std::vector<uint8_t> bytes = GenerateSMF(CORPUS_PROFILES[1].options);
+    FILE* file = fopen(midi_path.c_str(), "wb");
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+
+    std::string params = "\"profile\": \"" + std::string(CORPUS_PROFILES[1].name) + "\"";
+
+    Run("midi/from_file", params, [&] {
+        sink = midi::MIDI::FromFile(midi_path).get_unchecked().length;
+        return bytes.size();
+    });
+
+    // The entry is written as the temporary cache is destroyed
+    uint64_t content_hash;
+    if (MIDICache(cache_directory).Load(midi_path, content_hash).is_error())
+        return;
+
+    MIDICache cache(cache_directory);
+    Run("cache/load", params, [&] {
+        sink = cache.Load(midi_path, content_hash).get_unchecked().length;
+        return bytes.size();
+    });
+}
+
+// Time until a long file can start playing, streamed against parsed whole, to
+// compare with midi/from_file on the same profile
+void BenchmarkMIDIStream()
+{
+    char directory[] = "/tmp/wte-bench-XXXXXX";
+    if (mkdtemp(directory) == nullptr) return;
+
+    std::string midi_path = std::string(directory) + "/million_events.mid";
+
+    tb::scoped_guard remove_files = [&] {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    };
+
+    std::vector<uint8_t> bytes = GenerateSMF(CORPUS_PROFILES[1].options);
+    FILE* file = fopen(midi_path.c_str(), "wb");
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+
+    midi::MIDIStream measured;
+    if (measured.Open(midi_path).is_error()) return;
+
+    std::string params = "\"profile\": \"" + std::string(CORPUS_PROFILES[1].name)
+        + "\", \"stream_bytes\": " + std::to_string(measured.MemoryUsage())
+        + ", \"midi_bytes\": "
+        + std::to_string(midi::MIDI::FromFile(midi_path).get_unchecked().MemoryUsage());
+
+    Run("stream/open", params, [&] {
+        midi::MIDIStream stream;
+        sink = stream.Open(midi_path).is_error();
+        return 1;
+    });
+}
+
+// A library of exercise-sized files loaded one at a time against in one batch.
+// The batch only takes the io_uring path on a network filesystem, or with
+// WTE_IO_URING=1.
+void BenchmarkLibraryLoading()
+{
+    constexpr size_t FILE_COUNT = 1000;
+
+    char directory[] = "/tmp/wte-bench-XXXXXX";
+    if (mkdtemp(directory) == nullptr) return;
+
+    tb::scoped_guard remove_files = [&] {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    };
+
+    std::vector<uint8_t> midi = MakeSMF(1, 32);
+    std::vector<std::string> paths = tb::with_capacity(FILE_COUNT);
+    for (size_t i = 0; i < FILE_COUNT; ++i) {
+        const std::string& path = paths.emplace_back(
+            std::string(directory) + "/exercise" + std::to_string(i) + ".mid");
+        FILE* file = fopen(path.c_str(), "wb");
+        fwrite(midi.data(), 1, midi.size(), file);
+        fclose(file);
+    }
+
+    std::string params = "\"files\": " + std::to_string(FILE_COUNT)
+        + ", \"backend\": \"" + std::string(fileio::Backend(paths)) + "\"";
+
+    Run("library/load_each", params, [&] {
+        for (const std::string& path : paths)
+            sink = LoadMIDIBody(nullptr, path).midi.get_unchecked().length;
+        return paths.size();
+    });
+
+    Run("library/load_batch", params, [&] {
+        for (LoadedMIDI& loaded : LoadMIDIBodies(nullptr, paths))
+            sink = loaded.midi.get_unchecked().length;
+        return paths.size();
+    });
+}
+
+// The bundled manifest and MIDIs, with a large synthetic file, packed against
+// loaded loose. Run from the repository root.
+void BenchmarkResourcePack()
+{
+    char directory[] = "/tmp/wte-bench-XXXXXX";
+    if (mkdtemp(directory) == nullptr) return;
+
+    tb::scoped_guard remove_files = [&] {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    };
+
+    std::vector<std::string> midi_paths;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator("midis", error)) {
+        if (entry.path().extension() == ".mid")
+            midi_paths.push_back(entry.path());
+    }
+
+    std::string large_path = std::string(directory) + "/many_tracks.mid";
+    std::vector<uint8_t> large = GenerateSMF(CORPUS_PROFILES[0].options);
+    FILE* file = fopen(large_path.c_str(), "wb");
+    fwrite(large.data(), 1, large.size(), file);
+    fclose(file);
+    midi_paths.push_back(large_path);
+
+    std::vector<pack::File> files { { .name = "exercises.txt",
+                                      .bytes = ReadFile("exercises.txt") } };
+    size_t loose_bytes = files[0].bytes.size();
+    for (const std::string& path : midi_paths) {
+        files.push_back({ .name = path, .bytes = ReadFile(path.c_str()) });
+        loose_bytes += files.back().bytes.size();
+    }
+
+    std::string pack_path = std::string(directory) + "/bench.wtepack";
+    if (pack::WritePack(pack_path, files).is_error()) return;
+
+    auto pack_or_err = pack::ResourcePack::FromFile(pack_path);
+    if (pack_or_err.is_error()) return;
+    const pack::ResourcePack& resource_pack = pack_or_err.get_unchecked();
+
+    std::string params = "\"files\": " + std::to_string(files.size())
+        + ", \"loose_bytes\": " + std::to_string(loose_bytes)
+        + ", \"pack_bytes\": " + std::to_string(std::filesystem::file_size(pack_path));
+
+    Run("pack/inflate", params, [&] {
+        size_t bytes = 0;
+        for (const pack::Entry& entry : resource_pack.GetEntries())
+            bytes += resource_pack.Read(entry.name).get_unchecked().size();
+        return bytes;
+    });
+
+    uint64_t content_hash;
+    Run("pack/load_midis", params, [&] {
+        for (const std::string& path : midi_paths) {
+            std::string name = std::filesystem::path(path).lexically_normal();
+            sink = resource_pack.LoadMIDI(name, content_hash).get_unchecked().length;
+        }
+        return midi_paths.size();
+    });
+
+    Run("loose/load_midis", params, [&] {
+        for (const std::string& path : midi_paths)
+            sink = LoadMIDIFile(path, content_hash).get_unchecked().length;
+        return midi_paths.size();
+    });
+}
+
+auto WriteCorpus(std::string_view directory, uint64_t seed) -> int
+{
+    for (const CorpusProfile& profile : CORPUS_PROFILES) {
+        CorpusOptions options = profile.options;
+        options.seed = seed;
+
+        std::vector<uint8_t> bytes = GenerateSMF(options);
+        std::string path = std::string(directory) + "/" + std::string(profile.name) + ".mid";
+
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            fprintf(stderr, "Couldn't write '%s'\n", path.c_str());
+            return EXIT_FAILURE;
+        }
+
+        tb::scoped_guard close_file = [file] { fclose(file); };
+
+        if (fwrite(bytes.data(), 1, bytes.size(), file) < bytes.size()) {
+            fprintf(stderr, "Couldn't write '%s'\n", path.c_str());
+            return EXIT_FAILURE;
+        }
+
+        fprintf(stderr, "%s: %zu bytes\n", path.c_str(), bytes.size());
+    }
+
+    return 0;
+}
+
+auto WriteJSON(const char* path) -> bool
+{
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) return false;
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& result = results[i];
+        fprintf(file, "    { \"name\": \"%s\", \"params\": { %s }, \"iterations\": %lu, "
+               "\"ns_per_op\": %.1f, \"items_per_second\": %.1f }%s\n",
+            result.name.c_str(), result.params.c_str(), result.iterations,
+            result.ns_per_op, result.items_per_second,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return true;
+}
+
+auto main(int argc, char** argv) -> int
+{
+    if (argc >= 3 && std::string_view(argv[1]) == "corpus")
+        return WriteCorpus(argv[2], argc >= 4 ? strtoull(argv[3], nullptr, 10) : 1);
+
+    if (argc >= 3 && std::string_view(argv[1]) == "golden") {
+        const char* directory = argc >= 4 ? argv[3] : "bench/golden";
+        if (std::string_view(argv[2]) == "record")
+            return RecordGoldens(directory);
+        if (std::string_view(argv[2]) == "check")
+            return CheckGoldens(directory);
+    }
+
+    const char* output_path = argc >= 2 ? argv[1] : "bench-results.json";
+    if (argc >= 3)
+        filter = argv[2];
+
+    BenchmarkParser();
+    BenchmarkPlayer();
+    BenchmarkSynths();
+    BenchmarkGame();
+    BenchmarkExerciseManifest();
+    BenchmarkCorpus();
+    BenchmarkMIDICache();
+    BenchmarkMIDIStream();
+    BenchmarkLibraryLoading();
+    BenchmarkResourcePack();
+
+    if (!WriteJSON(output_path)) {
+        fprintf(stderr, "Couldn't write results to '%s'\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
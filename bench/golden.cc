@@ -0,0 +1,379 @@
+#include "golden.h"
+
+#include "smf.h"
+
+#include <tb/tb.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+
+constexpr int GOLDEN_SAMPLE_RATE = 48000;
+
+// Fidelity thresholds. Bit-exact changes pass trivially; approximations such as
+// wavetables or resampling have to stay this close to the recorded sound.
+constexpr double MIN_SNR_DB = 60;
+constexpr double MAX_PEAK_ERROR = 0.005;
+
+// Slowdowns beyond these fractions of the recorded time fail. Single renders are
+// short enough to be noisy, so the tighter limit applies to the whole set.
+constexpr double MAX_TOTAL_SLOWDOWN = 0.10;
+constexpr double MAX_RENDER_SLOWDOWN = 0.25;
+
+// Timings are the fastest of several renders, to keep scheduler noise out
+constexpr int TIMING_RUNS = 5;
+
+struct GoldenHeader
+{
+    char magic[4] = { 'W', 'T', 'E', 'G' };
+    uint32_t version = 1;
+    uint32_t sample_rate = 0;
+    uint32_t reserved = 0;
+    uint64_t sample_count = 0;
+    double ns_per_sample = 0;
+};
+
+struct GoldenRender
+{
+    std::string name;
+    std::vector<Sample> samples;
+    double ns_per_sample;
+};
+
+const Synth GOLDEN_SYNTHS[] { DEFAULT_SYNTH, STRING_SYNTH, FM_SYNTH, ORGAN_SYNTH, ANALOG_SYNTH };
+
+struct Piece
+{
+    std::string name;
+    midi::MIDI midi;
+    std::string path;   // Empty for pieces made in memory
+};
+
+// Renders until the cue ends. Nothing is rendered while a stream's decoder is
+// behind, so that only delays the render rather than changing it.
+auto RenderCue(const Cue& cue, const Synth& synth, int sample_rate) -> std::vector<Sample>
+{
+    PlaybackUnit playback_unit {
+        .generator { .sample_rate = sample_rate },
+        .synth = synth
+    };
+    playback_unit.generator.strings.Allocate(sample_rate);
+    playback_unit.transport.cues.Push(cue).ignore_error();
+
+    std::vector<Sample> output;
+    std::span<const Sample> buffer = playback_unit.sample_buffer.view();
+
+    for (;;) {
+        size_t count = RenderFilePlayback(playback_unit, buffer.size());
+        output.insert(output.end(), buffer.begin(), buffer.begin() + count);
+
+        if (count == 0) {
+            if (!playback_unit.transport.current) break;
+            std::this_thread::yield();
+        }
+    }
+
+    return output;
+}
+
+auto RenderOffline(const midi::MIDI& midi, const Synth& synth, int sample_rate)
+    -> std::vector<Sample>
+{
+    return RenderCue({ .type = Cue::PLAY_MIDI, .midi = &midi }, synth, sample_rate);
+}
+
+auto RenderOffline(midi::MIDIStream& stream, const Synth& synth, int sample_rate)
+    -> std::vector<Sample>
+{
+    return RenderCue({ .type = Cue::PLAY_STREAM, .stream = &stream }, synth, sample_rate);
+}
+
+// Chords under an overlapping melody, with a tempo change halfway and a fast
+// run at the end, so every synth is heard attacking, sustaining and cutting off
+auto MakePhrase() -> std::vector<uint8_t>
+{
+    constexpr uint16_t TICKS_PER_QUARTER_NOTE = 480;
+    constexpr uint32_t BAR = 4 * TICKS_PER_QUARTER_NOTE;
+    const uint8_t chords[][3] { { 48, 52, 55 }, { 53, 57, 60 }, { 55, 59, 62 }, { 48, 55, 64 } };
+    const uint8_t melody[] { 72, 74, 76, 77, 79, 77, 76, 74 };
+
+    SMFBuilder smf(0, TICKS_PER_QUARTER_NOTE);
+    smf.BeginTrack();
+    smf.Tempo(0, 500000);
+
+    for (size_t bar = 0; bar < std::size(chords); ++bar) {
+        if (bar == 2)
+            smf.Tempo(0, 400000);
+
+        for (size_t i = 0; i < 3; ++i)
+            smf.Channel(0, 0x90, chords[bar][i], 70 + 10 * i);
+
+        // The first melody note is released just after the second starts
+        uint8_t first = melody[bar * 2 % std::size(melody)];
+        uint8_t second = melody[(bar * 2 + 1) % std::size(melody)];
+        smf.Channel(0, 0x90, first, 100);
+        smf.Channel(BAR / 2, 0x90, second, 100);
+        smf.Channel(120, 0x80, first, 0);
+        smf.Channel(BAR / 2 - 120, 0x80, second, 0);
+        for (size_t i = 0; i < 3; ++i)
+            smf.Channel(0, 0x80, chords[bar][i], 0);
+    }
+
+    for (uint8_t note = 60; note <= 84; note += 2) {
+        smf.Channel(0, 0x90, note, 90);
+        smf.Channel(TICKS_PER_QUARTER_NOTE / 8, 0x80, note, 0);
+    }
+
+    smf.EndTrack();
+    return smf.Finish();
+}
+
+auto LoadPieces() -> std::vector<Piece>
+{
+    std::vector<Piece> pieces;
+
+    std::vector<uint8_t> phrase = MakePhrase();
+    FILE* file = OpenMemory(phrase);
+    auto midi = midi::MIDI::FromStream(file);
+    fclose(file);
+    if (!midi.is_error())
+        pieces.push_back({ "phrase", std::move(midi.get_mut_unchecked()) });
+
+    for (const char* name : { "example", "example2", "example3" }) {
+        std::string path = "midis/" + std::string(name) + ".mid";
+        auto midi = midi::MIDI::FromFile(path);
+        if (midi.is_error()) {
+            fprintf(stderr, "Skipping %s: %s\n", path.c_str(), midi.get_error().What().data());
+            continue;
+        }
+        pieces.push_back({ name, std::move(midi.get_mut_unchecked()), path });
+    }
+
+    return pieces;
+}
+
+auto RenderGoldens() -> std::vector<GoldenRender>
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<GoldenRender> renders;
+
+    for (const Piece& piece : LoadPieces()) {
+        for (const Synth& synth : GOLDEN_SYNTHS) {
+            GoldenRender render {
+                .name = piece.name + "-" + std::string(synth.name),
+                .ns_per_sample = std::numeric_limits<double>::infinity()
+            };
+
+            for (int run = 0; run < TIMING_RUNS; ++run) {
+                Clock::time_point start = Clock::now();
+                render.samples = RenderOffline(piece.midi, synth, GOLDEN_SAMPLE_RATE);
+                double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                    .count();
+                render.ns_per_sample = std::min(render.ns_per_sample,
+                    ns / std::max<size_t>(render.samples.size(), 1));
+            }
+
+            renders.push_back(std::move(render));
+        }
+    }
+
+    return renders;
+}
+
+// Streaming is only a different way of reading the file, so its renders have to
+// match the whole file's exactly rather than within the fidelity thresholds
+auto CheckStreams() -> bool
+{
+    char directory[] = "/tmp/wte-golden-XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        fprintf(stderr, "%-24s FAIL: couldn't make a temporary directory\n", "streams");
+        return false;
+    }
+
+    tb::scoped_guard remove_files = [&] {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    };
+
+    // The phrase is written out too, as the one piece that changes tempo
+    std::string phrase_path = std::string(directory) + "/phrase.mid";
+    std::vector<uint8_t> phrase = MakePhrase();
+    if (FILE* file = fopen(phrase_path.c_str(), "wb")) {
+        fwrite(phrase.data(), 1, phrase.size(), file);
+        fclose(file);
+    }
+
+    bool passed = true;
+
+    for (const Piece& piece : LoadPieces()) {
+        const std::string& path = piece.path.empty() ? phrase_path : piece.path;
+
+        for (const Synth& synth : GOLDEN_SYNTHS) {
+            std::string name = piece.name + "-" + std::string(synth.name) + "-stream";
+
+            midi::MIDIStream stream;
+            if (auto result = stream.Open(path); result.is_error()) {
+                fprintf(stderr, "%-24s FAIL: %s\n", name.c_str(),
+                    result.get_error().What().data());
+                passed = false;
+                continue;
+            }
+
+            std::vector<Sample> whole = RenderOffline(piece.midi, synth, GOLDEN_SAMPLE_RATE);
+            std::vector<Sample> streamed = RenderOffline(stream, synth, GOLDEN_SAMPLE_RATE);
+
+            auto [whole_end, streamed_end] = std::ranges::mismatch(whole, streamed);
+            bool identical = whole_end == whole.end() && streamed_end == streamed.end();
+            passed = passed && identical;
+
+            if (identical) {
+                fprintf(stderr, "%-24s %10zu samples, identical to the whole file  ok\n",
+                    name.c_str(), streamed.size());
+            } else {
+                fprintf(stderr, "%-24s FAIL: differs from the whole file from sample %zu\n",
+                    name.c_str(), static_cast<size_t>(whole_end - whole.begin()));
+            }
+        }
+    }
+
+    return passed;
+}
+
+auto GoldenPath(const char* directory, const std::string& name) -> std::string
+{
+    return std::string(directory) + "/" + name + ".golden";
+}
+
+// Samples are stored in the host's byte order, as goldens are recorded and
+// checked on the same machine
+auto WriteGolden(const char* directory, const GoldenRender& render) -> bool
+{
+    FILE* file = fopen(GoldenPath(directory, render.name).c_str(), "wb");
+    if (file == nullptr) return false;
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+
+    GoldenHeader header {
+        .sample_rate = GOLDEN_SAMPLE_RATE,
+        .sample_count = render.samples.size(),
+        .ns_per_sample = render.ns_per_sample
+    };
+
+    return fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(render.samples.data(), sizeof(Sample), render.samples.size(), file)
+           == render.samples.size();
+}
+
+auto ReadGolden(const char* directory, const std::string& name)
+    -> std::optional<GoldenRender>
+{
+    FILE* file = fopen(GoldenPath(directory, name).c_str(), "rb");
+    if (file == nullptr) return std::nullopt;
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+
+    GoldenHeader header, expected;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0
+        || header.version != expected.version
+        || header.sample_rate != GOLDEN_SAMPLE_RATE)
+        return std::nullopt;
+
+    GoldenRender golden {
+        .name = name,
+        .samples = std::vector<Sample>(header.sample_count),
+        .ns_per_sample = header.ns_per_sample
+    };
+
+    if (fread(golden.samples.data(), sizeof(Sample), header.sample_count, file)
+        != header.sample_count)
+        return std::nullopt;
+
+    return golden;
+}
+
+auto RecordGoldens(const char* directory) -> int
+{
+    mkdir(directory, 0755);
+
+    for (const GoldenRender& render : RenderGoldens()) {
+        if (!WriteGolden(directory, render)) {
+            fprintf(stderr, "Couldn't write '%s'\n", GoldenPath(directory, render.name).c_str());
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "%-24s %10zu samples %8.2f ns/sample\n", render.name.c_str(),
+            render.samples.size(), render.ns_per_sample);
+    }
+
+    return 0;
+}
+
+auto CheckGoldens(const char* directory) -> int
+{
+    bool passed = true;
+    double total_ns = 0, golden_total_ns = 0;
+
+    for (const GoldenRender& render : RenderGoldens()) {
+        std::optional<GoldenRender> golden = ReadGolden(directory, render.name);
+        if (!golden) {
+            fprintf(stderr, "%-24s FAIL: no golden in '%s'\n", render.name.c_str(), directory);
+            passed = false;
+            continue;
+        }
+
+        if (golden->samples.size() != render.samples.size()) {
+            fprintf(stderr, "%-24s FAIL: %zu samples, golden has %zu\n", render.name.c_str(),
+                render.samples.size(), golden->samples.size());
+            passed = false;
+            continue;
+        }
+
+        double signal = 0, noise = 0, peak_error = 0;
+        for (size_t i = 0; i < render.samples.size(); ++i) {
+            double error = static_cast<double>(render.samples[i]) - golden->samples[i];
+            signal += static_cast<double>(golden->samples[i]) * golden->samples[i];
+            noise += error * error;
+            peak_error = std::max(peak_error, std::abs(error));
+        }
+
+        double snr = noise == 0 ? std::numeric_limits<double>::infinity()
+                   : 10 * std::log10(signal / noise);
+        double slowdown = render.ns_per_sample / golden->ns_per_sample - 1;
+        total_ns += render.ns_per_sample * render.samples.size();
+        golden_total_ns += golden->ns_per_sample * golden->samples.size();
+
+        const char* verdict = snr < MIN_SNR_DB || peak_error > MAX_PEAK_ERROR ? "FAIL: fidelity"
+                            : slowdown > MAX_RENDER_SLOWDOWN ? "FAIL: throughput"
+                            : "ok";
+        if (verdict[0] == 'F')
+            passed = false;
+
+        fprintf(stderr, "%-24s SNR %7.1f dB  peak error %.2e  %8.2f ns/sample (%+6.1f%%)  %s\n",
+            render.name.c_str(), snr, peak_error, render.ns_per_sample, slowdown * 100,
+            verdict);
+    }
+
+    if (golden_total_ns > 0) {
+        double slowdown = total_ns / golden_total_ns - 1;
+        bool too_slow = slowdown > MAX_TOTAL_SLOWDOWN;
+        passed = passed && !too_slow;
+
+        fprintf(stderr, "%-24s %.1f ms, recorded %.1f ms (%+.1f%%)  %s\n", "total",
+            total_ns / 1e6, golden_total_ns / 1e6, slowdown * 100,
+            too_slow ? "FAIL: throughput" : "ok");
+    }
+
+    passed = CheckStreams() && passed;
+
+    return passed ? 0 : EXIT_FAILURE;
+}
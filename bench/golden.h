@@ -0,0 +1,23 @@
+#pragma once
+
+#include "midi.h"
+#include "midistream.h"
+#include "sound.h"
+
+#include <vector>
+
+// Renders through the file playback path exactly as the audio callback would,
+// with no device and no real-time pacing
+auto RenderOffline(const midi::MIDI& midi, const Synth& synth, int sample_rate)
+    -> std::vector<Sample>;
+// As above, waiting on the stream's decoder wherever playback catches up with it
+auto RenderOffline(midi::MIDIStream& stream, const Synth& synth, int sample_rate)
+    -> std::vector<Sample>;
+
+// Renders the golden set and either records it to directory or checks it
+// against the recording there. A check fails if any render's fidelity drops
+// below the thresholds in golden.cc, or if it has slowed down by more than the
+// allowed margin, or if streaming any piece changes a single sample of its
+// render. Returns an exit code.
+auto RecordGoldens(const char* directory) -> int;
+auto CheckGoldens(const char* directory) -> int;
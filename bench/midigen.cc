@@ -0,0 +1,117 @@
+#include "midigen.h"
+
+#include "smf.h"
+
+#include <algorithm>
+
+constexpr uint16_t CORPUS_TICKS_PER_QUARTER_NOTE = 480;
+
+// SplitMix64, as the standard distributions aren't the same across standard
+// libraries and the output has to be reproducible
+class CorpusRandom
+{
+public:
+    CorpusRandom(uint64_t seed) : state_(seed) {}
+
+    auto Next() -> uint64_t
+    {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        return z ^ (z >> 31);
+    }
+
+    auto Below(uint64_t bound) -> uint64_t
+    {
+        return bound == 0 ? 0 : Next() % bound;
+    }
+
+    auto Chance(float probability) -> bool
+    {
+        return (Next() >> 40) < probability * (1 << 24);
+    }
+
+private:
+    uint64_t state_;
+};
+
+// Notes that are on, so every note on is eventually matched by a note off
+struct HeldNote
+{
+    uint8_t channel, note;
+};
+
+void GenerateTrack(SMFBuilder& smf, const CorpusOptions& options, CorpusRandom& random,
+    bool tempo_track)
+{
+    constexpr size_t MAX_HELD_NOTES = 8;
+
+    std::vector<HeldNote> held;
+    std::vector<uint8_t> sysex(std::max<size_t>(options.max_sysex_length, 2));
+    uint64_t ticks_since_tempo = 0;
+    const uint64_t ticks_per_tempo_change = options.tempo_changes_per_beat > 0
+        ? CORPUS_TICKS_PER_QUARTER_NOTE / options.tempo_changes_per_beat : 0;
+
+    smf.BeginTrack();
+
+    for (size_t event = 0; event < options.events_per_track; ++event) {
+        auto delta = static_cast<uint32_t>(random.Below(2 * options.mean_delta_ticks + 1));
+        ticks_since_tempo += delta;
+
+        if (tempo_track && ticks_per_tempo_change > 0
+            && ticks_since_tempo >= ticks_per_tempo_change) {
+            smf.Tempo(delta, 300000 + random.Below(700000));
+            ticks_since_tempo = 0;
+            continue;
+        }
+
+        if (options.sysex_per_event > 0 && random.Chance(options.sysex_per_event)) {
+            size_t length = 2 + random.Below(sysex.size() - 1);
+            for (size_t i = 0; i < length - 1; ++i)
+                sysex[i] = random.Below(0x80);
+            sysex[length - 1] = 0xF7;
+            smf.SysEx(delta, { sysex.data(), length });
+            continue;
+        }
+
+        auto channel = static_cast<uint8_t>(random.Below(options.channel_count));
+        uint64_t kind = random.Below(16);
+
+        if (!held.empty() && (kind < 6 || held.size() >= MAX_HELD_NOTES)) {
+            size_t index = random.Below(held.size());
+            HeldNote note = held[index];
+            held.erase(held.begin() + index);
+            smf.Channel(delta, 0x80 | note.channel, note.note, 64, options.running_status);
+        } else if (kind < 12) {
+            HeldNote note { channel, static_cast<uint8_t>(24 + random.Below(80)) };
+            held.push_back(note);
+            smf.Channel(delta, 0x90 | note.channel, note.note,
+                1 + random.Below(127), options.running_status);
+        } else if (kind < 14) {
+            smf.Channel(delta, 0xB0 | channel, random.Below(120), random.Below(128),
+                options.running_status);
+        } else if (kind < 15) {
+            smf.Channel(delta, 0xE0 | channel, random.Below(128), random.Below(128),
+                options.running_status);
+        } else {
+            smf.Channel(delta, 0xC0 | channel, random.Below(128), 0,
+                options.running_status);
+        }
+    }
+
+    for (HeldNote note : held)
+        smf.Channel(0, 0x80 | note.channel, note.note, 64, options.running_status);
+
+    smf.EndTrack();
+}
+
+auto GenerateSMF(const CorpusOptions& options) -> std::vector<uint8_t>
+{
+    SMFBuilder smf(options.track_count > 1 ? 1 : 0, CORPUS_TICKS_PER_QUARTER_NOTE);
+    CorpusRandom random(options.seed);
+
+    for (uint16_t track = 0; track < options.track_count; ++track)
+        GenerateTrack(smf, options, random, track == 0);
+
+    return smf.Finish();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Settings for one synthetic stress-test file. The same options and seed always
+// produce the same bytes.
+struct CorpusOptions
+{
+    uint64_t seed = 1;
+    uint16_t track_count = 16;
+    size_t events_per_track = 10000;
+    uint32_t mean_delta_ticks = 60;         // Event density
+    float tempo_changes_per_beat = 0.25f;   // On the first track
+    uint8_t channel_count = 16;
+    bool running_status = false;
+    float sysex_per_event = 0;
+    uint16_t max_sysex_length = 256;
+};
+
+struct CorpusProfile
+{
+    std::string_view name;
+    CorpusOptions options;
+};
+
+// Shapes the bundled MIDIs never reach
+constexpr CorpusProfile CORPUS_PROFILES[] {
+    { "many_tracks", { .track_count = 100, .events_per_track = 2000 } },
+    { "million_events", { .track_count = 4, .events_per_track = 250000 } },
+    { "tempo_heavy", { .track_count = 8, .events_per_track = 20000,
+                       .tempo_changes_per_beat = 4 } },
+    { "running_status", { .track_count = 8, .events_per_track = 50000,
+                          .channel_count = 1, .running_status = true } },
+    { "sysex_laden", { .track_count = 8, .events_per_track = 20000,
+                       .sysex_per_event = 0.5f } }
+};
+
+auto GenerateSMF(const CorpusOptions& options) -> std::vector<uint8_t>;
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <span>
+#include <vector>
+
+// Builds Standard MIDI Files in memory, for feeding the parser inputs of any
+// size without shipping them
+class SMFBuilder
+{
+public:
+    SMFBuilder(uint16_t format, uint16_t ticks_per_quarter_note)
+    : format_(format), ticks_per_quarter_note_(ticks_per_quarter_note) {}
+
+    void BeginTrack()
+    {
+        track_start_ = bytes_.size();
+        Append({ 'M', 'T', 'r', 'k', 0, 0, 0, 0 });
+        running_status_ = 0;
+        ++track_count_;
+    }
+
+    void EndTrack()
+    {
+        Meta(0, 0x2F, {});
+        uint32_t length = bytes_.size() - track_start_ - 8;
+        for (int i = 0; i < 4; ++i)
+            bytes_[track_start_ + 4 + i] = length >> (24 - 8 * i);
+    }
+
+    // Status bytes are left out when they repeat, if running status is on
+    void Channel(uint32_t delta, uint8_t status, uint8_t data1, uint8_t data2,
+        bool running_status = false)
+    {
+        VariableLength(delta);
+        if (!running_status || status != running_status_)
+            bytes_.push_back(status);
+        running_status_ = status;
+
+        bytes_.push_back(data1);
+        if ((status & 0xF0) != 0xC0 && (status & 0xF0) != 0xD0)
+            bytes_.push_back(data2);
+    }
+
+    void Meta(uint32_t delta, uint8_t type, std::span<const uint8_t> data)
+    {
+        VariableLength(delta);
+        Append({ 0xFF, type });
+        VariableLength(data.size());
+        Append(data);
+        running_status_ = 0;
+    }
+
+    void Tempo(uint32_t delta, uint32_t usec_per_quarter_note)
+    {
+        const uint8_t data[] = {
+            static_cast<uint8_t>(usec_per_quarter_note >> 16),
+            static_cast<uint8_t>(usec_per_quarter_note >> 8),
+            static_cast<uint8_t>(usec_per_quarter_note)
+        };
+        Meta(delta, 0x51, data);
+    }
+
+    void SysEx(uint32_t delta, std::span<const uint8_t> data)
+    {
+        VariableLength(delta);
+        bytes_.push_back(0xF0);
+        VariableLength(data.size());
+        Append(data);
+        running_status_ = 0;
+    }
+
+    auto Finish() -> std::vector<uint8_t>
+    {
+        std::vector<uint8_t> file {
+            'M', 'T', 'h', 'd', 0, 0, 0, 6,
+            static_cast<uint8_t>(format_ >> 8), static_cast<uint8_t>(format_),
+            static_cast<uint8_t>(track_count_ >> 8), static_cast<uint8_t>(track_count_),
+            static_cast<uint8_t>(ticks_per_quarter_note_ >> 8),
+            static_cast<uint8_t>(ticks_per_quarter_note_)
+        };
+        file.reserve(file.size() + bytes_.size());
+        file.insert(file.end(), bytes_.begin(), bytes_.end());
+        return file;
+    }
+
+private:
+    void Append(std::span<const uint8_t> data)
+    {
+        bytes_.insert(bytes_.end(), data.begin(), data.end());
+    }
+
+    void Append(std::initializer_list<uint8_t> data)
+    {
+        bytes_.insert(bytes_.end(), data.begin(), data.end());
+    }
+
+    void VariableLength(uint32_t value)
+    {
+        uint8_t groups[5];
+        int count = 0;
+        do {
+            groups[count++] = value & 0x7F;
+            value >>= 7;
+        } while (value != 0);
+
+        while (count-- > 0)
+            bytes_.push_back(groups[count] | (count > 0 ? 0x80 : 0));
+    }
+
+    std::vector<uint8_t> bytes_;
+    size_t track_start_ = 0;
+    uint16_t format_, ticks_per_quarter_note_, track_count_ = 0;
+    uint8_t running_status_ = 0;
+};
+
+// Reads a file held in memory through the stdio interface the parser takes
+inline auto OpenMemory(std::span<const uint8_t> bytes) -> FILE*
+{
+    return fmemopen(const_cast<uint8_t*>(bytes.data()), bytes.size(), "rb");
+}
@@ -1 +1,22 @@
-c++ -std=c++20 -Wall -lSDL3 -lusb-1.0 src/*.cc -o wte
+# ./build.sh debug reports allocations, locks and blocking I/O in audio callbacks
+# ./build.sh bench builds the benchmarks as wte-bench
+# ./build.sh pack builds the resource pack tool as wte-pack
+LIBS="-lSDL3 -lusb-1.0 -lz"
+
+case "$1" in
+debug)
+    FLAGS="-g -DWTE_RT_CHECKS -rdynamic -ldl"
+    ;;
+bench)
+    c++ -std=c++20 -Wall -O2 -Isrc $LIBS $(ls src/*.cc | grep -v src/main.cc) \
+        bench/*.cc -o wte-bench
+    exit
+    ;;
+pack)
+    c++ -std=c++20 -Wall -O2 -Isrc $LIBS $(ls src/*.cc | grep -v src/main.cc) \
+        tools/*.cc -o wte-pack
+    exit
+    ;;
+esac
+
+c++ -std=c++20 -Wall $FLAGS $LIBS src/*.cc -o wte
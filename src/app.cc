@@ -2,7 +2,9 @@
 
 #include "events.h"
 
+#include <cstring>
 #include <random>
+#include <utility>
 
 void ReadUSBPacket(libusb_transfer* transfer)
 {
@@ -62,6 +64,53 @@ auto AppContext::LoadResources(std::string_view exercises_path,
     return tb::ok;
 }
 
+auto AppContext::LoadSoundFont(std::string_view path) -> tb::error<sf2::Error>
+{
+    auto soundfont_or_err = sf2::SoundFont::FromFile(path);
+    if (soundfont_or_err.is_error())
+        return soundfont_or_err.get_error();
+
+    soundfont = std::move(soundfont_or_err.get_mut_unchecked());
+
+    // General MIDI acoustic grand piano
+    auto instrument_or_err = soundfont->GetInstrument(0, 0);
+    if (instrument_or_err.is_error())
+        return instrument_or_err.get_error();
+
+    instrument = std::move(instrument_or_err.get_mut_unchecked());
+
+    if (sound_ctx.realtime) {
+        if (auto result = sf2::LockInstrumentMemory(instrument); result.is_error()) {
+            tb::print("Real-time mode: {}: {}\n", result.get_error().What(),
+                strerror(result.get_error().errno_value));
+        }
+    }
+
+    synths.push_back(Synth {
+        .render_fn = sf2::RenderSampler,
+        .instrument = &instrument,
+        .release = instrument.release,
+        .name = "soundfont"
+    });
+    SelectSynth(synths.size() - 1);
+
+    return tb::ok;
+}
+
+void AppContext::SelectSynth(size_t index)
+{
+    current_synth = index % synths.size();
+
+    // Audio stream callbacks run with the stream locked
+    for (PlaybackUnit* unit : { &sound_ctx.live_playback, &sound_ctx.file_playback }) {
+        SDL_LockAudioStream(unit->stream.get());
+        unit->synth = synths[current_synth];
+        SDL_UnlockAudioStream(unit->stream.get());
+    }
+
+    tb::print("Instrument: {}\n", synths[current_synth].name);
+}
+
 auto AppContext::SetupMIDIControllerConnection() -> tb::error<usb::Error>
 {
     auto list_or_err = usb::IndexDevices();
@@ -127,38 +176,210 @@ void AppContext::PlayLiveMIDIEvent(const MIDIInputEvent& event)
     generator.sample_point -= samples_queued;
 }
 
+void AppContext::Rewind(double seconds)
+{
+    PlaybackUnit& unit = sound_ctx.file_playback;
+    midi::Player& player = unit.player;
+
+    SDL_LockAudioStream(unit.stream.get());
+
+    // During a pause the player still holds the MIDI before it, which a seek
+    // would replay ahead of what the pause leads into
+    const std::optional<Cue>& cue = unit.transport.current;
+    bool pausing = cue && cue->type == Cue::PAUSE;
+
+    if (const midi::MIDI* midi = player.GetMIDI(); midi && !pausing) {
+        const midi::TempoMap& tempo_map = midi->tempo_map;
+        double position = tempo_map.TicksToSeconds(player.GetTicksElapsed());
+        if (unit.scheduler.IsAnchoredTo(player)) {
+            position = unit.scheduler.ScaledUsecAt(unit.sample_position)
+                     / (midi->ticks_per_quarter_note * 1e6);
+        }
+
+        player.Seek(tempo_map.SecondsToTicks(std::max(position - seconds, 0.0)));
+    }
+
+    SDL_UnlockAudioStream(unit.stream.get());
+}
+
+void AppContext::ChangePlaybackRate(float change)
+{
+    constexpr float MIN_PLAYBACK_RATE = 0.25f, MAX_PLAYBACK_RATE = 2.f;
+
+    std::atomic<float>& rate = sound_ctx.file_playback.playback_rate;
+    float new_rate = std::clamp(rate.load() + change, MIN_PLAYBACK_RATE,
+        MAX_PLAYBACK_RATE);
+
+    rate.store(new_rate, std::memory_order_relaxed);
+    tb::print("Playback speed: {}%\n", static_cast<int>(new_rate * 100 + 0.5f));
+}
+
+// Repeats the whole MIDI that is playing until toggled off, after which it plays
+// on to the end
+void AppContext::ToggleLoop()
+{
+    PlaybackUnit& unit = sound_ctx.file_playback;
+    midi::Player& player = unit.player;
+
+    SDL_LockAudioStream(unit.stream.get());
+
+    if (player.GetLoop()) {
+        player.ClearLoop();
+        tb::print("Looping off\n");
+    } else if (const midi::MIDI* midi = player.GetMIDI(); midi && !player.Done()) {
+        // Streams can't loop
+        player.SetLoop({ .start = 0, .end = midi->length });
+        if (player.GetLoop())
+            tb::print("Looping on\n");
+    }
+
+    SDL_UnlockAudioStream(unit.stream.get());
+}
+
+void AppContext::ToggleMetronome()
+{
+    std::atomic<bool>& enabled = sound_ctx.file_playback.metronome.enabled;
+    enabled = !enabled;
+    tb::print("Metronome {}\n", enabled ? "on" : "off");
+}
+
 void AppContext::BeginExercise()
 {
     static std::random_device rand_dev;
     static std::uniform_int_distribution<int> player_transposition(-6, 6);
+    constexpr size_t TIMELINE_CUES = 3;
+
+    if (game.GetState() != GameState::WAIT_FOR_READY || accompaniment_playing)
+        return;
 
-    if (game.GetState() != GameState::WAIT_FOR_READY)
+    // Checked before the game moves on. Only this thread pushes cues, so there
+    // is at least this much room when the timeline is pushed below.
+    PlaybackUnit& unit = sound_ctx.file_playback;
+    if (unit.transport.cues.Space() < TIMELINE_CUES) {
+        tb::print("Too many queued cues\n");
         return;
+    }
 
-    if (game.BeginNewExercise().is_error())
+    auto begun = game.BeginNewExercise();
+    if (begun.is_error()) {
+        tb::print("Couldn't begin exercise: {}\n", begun.get_error().What());
         return;
+    }
 
-    midi::Player& player = sound_ctx.file_playback.player;
+    ExerciseMIDIs& loaded = begun.get_mut_unchecked();
+    std::array<SharedMIDI, 2> midis { std::move(loaded.cadence), std::move(loaded.exercise) };
+
+    auto transposition = static_cast<uint8_t>(player_transposition(rand_dev));
+    const midi::MIDI& exercise = *midis[1];
+
+    Cue gap {
+        .type = Cue::PAUSE,
+        .pause_samples = static_cast<uint32_t>(
+            CADENCE_GAP_SECONDS * unit.generator.sample_rate),
+        .tag = GAP_CUE
+    };
+
+    // With the metronome on, the gap becomes a bar counted in at the exercise's
+    // opening tempo and metre
+    if (unit.metronome.enabled && exercise.beats.size() > 1) {
+        auto downbeat = std::ranges::find_if(exercise.beats.begin() + 1,
+            exercise.beats.end(), &midi::Beat::downbeat);
+        uint32_t beats_per_bar = downbeat != exercise.beats.end()
+                               ? downbeat - exercise.beats.begin() : 4;
+
+        double beat_seconds = exercise.tempo_map.TicksToSeconds(exercise.beats[1].tick)
+                            / unit.playback_rate.load();
+        gap.pause_samples = static_cast<uint32_t>(
+            beats_per_bar * beat_seconds * unit.generator.sample_rate);
+        gap.count_in_beats = beats_per_bar;
+    }
 
-    player.transposition_offset_ = player_transposition(rand_dev);
-    player.SetMIDI(*game.GetCurrentCadenceMIDI());
+    // Queued as one timeline, so the audio thread moves from cadence to exercise
+    // without waiting for the main loop
+    const std::array<Cue, TIMELINE_CUES> timeline {{
+        { .type = Cue::PLAY_MIDI, .midi = midis[0].get(),
+          .transposition = transposition, .tag = CADENCE_CUE },
+        gap,
+        { .type = Cue::PLAY_MIDI, .midi = &exercise,
+          .transposition = transposition, .tag = EXERCISE_CUE }
+    }};
+
+    // Held before any cue can reach the audio thread
+    queued_midis = std::move(midis);
+    for (const Cue& cue : timeline)
+        unit.transport.cues.Push(cue).ignore_error();
 }
 
-void AppContext::MIDIEnded()
+// Only between exercises, which share the file player with it
+void AppContext::PlayAccompaniment()
 {
-    midi::Player& player = sound_ctx.file_playback.player;
+    if (accompaniment_path.empty() || accompaniment_playing
+        || game.GetState() != GameState::WAIT_FOR_READY)
+        return;
+
+    auto stream = std::make_unique<midi::MIDIStream>();
+    if (auto result = stream->Open(accompaniment_path); result.is_error()) {
+        tb::print("Couldn't play '{}': {}\n", accompaniment_path, result.get_error().What());
+        return;
+    }
 
-    switch (game.GetState()) {
-    case GameState::PLAYING_CADENCE:
-        player.SetMIDI(resources.midis[game.GetCurrentExercise()->midi]);
-        game.MIDIEnded();
+    Cue cue { .type = Cue::PLAY_STREAM, .stream = stream.get(), .tag = ACCOMPANIMENT_CUE };
+    if (sound_ctx.file_playback.transport.cues.Push(cue).is_error()) {
+        tb::print("Too many queued cues\n");
+        return;
+    }
+
+    queued_stream = std::move(stream);
+    accompaniment_playing = true;
+}
+
+void AppContext::CueChanged(const TransportEvent& event)
+{
+    switch (event.tag) {
+    case CADENCE_CUE:
+        // The player has let go of the previous timeline's MIDIs
+        if (event.state == CueState::STARTED) {
+            playing_midis = std::exchange(queued_midis, {});
+            playing_stream = nullptr;
+        }
+        break;
+    case ACCOMPANIMENT_CUE:
+        // As above, for the stream
+        if (event.state == CueState::STARTED) {
+            playing_midis = {};
+            playing_stream = std::exchange(queued_stream, nullptr);
+        } else {
+            accompaniment_playing = false;
+        }
         break;
-    case GameState::PLAYING_EXERCISE:
-        tb::print("Now play it in the key of {}!\n",
-            midi::NoteName(game.GetRequiredInputKey()));
-        game.MIDIEnded();
+    case EXERCISE_CUE:
+        if (event.state == CueState::STARTED) {
+            game.MIDIEnded();
+        } else if (game.GetState() == GameState::PLAYING_EXERCISE) {
+            tb::print("Now play it in the key of {}!\n",
+                midi::NoteName(game.GetRequiredInputKey()));
+            game.MIDIEnded();
+        }
         break;
     default:
         break;
     }
 }
+
+// Changed MIDIs are swapped in for exercises begun from now on, while any
+// timeline already queued plays on with what it holds
+void AppContext::ReloadResources()
+{
+    std::optional<ResourceUpdate> update = watcher->TakeUpdate();
+    if (!update)
+        return;
+
+    size_t file_count = update->midis.size() + (update->exercises ? 1 : 0);
+    if (auto result = resources.ApplyUpdate(std::move(*update)); result.is_error())
+        tb::print("Couldn't reload exercises: {}\n", result.get_error().What());
+    else
+        tb::print("Reloaded {} changed file(s)\n", file_count);
+
+    // The manifest may have brought in new MIDIs
+    watcher->WatchFiles(resources.GetMIDIPaths());
+}
@@ -1,35 +1,76 @@
 #pragma once
 
+#include "cache.h"
 #include "events.h"
 #include "game.h"
 #include "midi.h"
+#include "pack.h"
+#include "sf2.h"
 #include "sound.h"
 #include "usb.h"
+#include "watch.h"
 
 #include <SDL3/SDL_video.h>
 
 #include <tb/tb.h>
 
 #include <memory>
+#include <optional>
+#include <string>
 
 using UWindow = std::unique_ptr<SDL_Window, tb::deleter<SDL_DestroyWindow>>;
 
 struct LoadResourcesError {};
 
+// Silence between the cadence and the exercise that follows it
+constexpr double CADENCE_GAP_SECONDS = 0.5;
+
+enum PlaybackCue : uint32_t { CADENCE_CUE, GAP_CUE, EXERCISE_CUE, ACCOMPANIMENT_CUE };
+
 struct AppContext
 {
     SoundContext sound_ctx;
+    std::optional<MIDICache> midi_cache;
+    std::optional<pack::ResourcePack> resource_pack;
     Resources resources;
     Game game { resources };
+    std::optional<ResourceWatcher> watcher;     // Destroyed before the cache
     usb::DeviceHandle device_handle;
     usb::PollingContext polling_ctx {};
     UWindow window;
+    std::optional<sf2::SoundFont> soundfont;
+    sf2::Instrument instrument;
+    std::vector<Synth> synths {
+        DEFAULT_SYNTH, STRING_SYNTH, FM_SYNTH, ORGAN_SYNTH, ANALOG_SYNTH
+    };
+    size_t current_synth = 0;
+
+    // Held for the file player: the timeline it is on or last finished, and
+    // one queued after it
+    std::array<SharedMIDI, 2> playing_midis;
+    std::array<SharedMIDI, 2> queued_midis;
+
+    // Played along to between exercises, from WTE_ACCOMPANIMENT. Streamed, as
+    // it may be long. A stream drains as it plays, so each play opens its own,
+    // held like the MIDIs above until a later timeline starts.
+    std::string accompaniment_path;
+    std::unique_ptr<midi::MIDIStream> playing_stream;
+    std::unique_ptr<midi::MIDIStream> queued_stream;
+    bool accompaniment_playing = false;
 
     auto LoadResources(std::string_view exercises_path,
         std::string_view major_cadence, std::string_view minor_cadence)
     -> tb::error<LoadResourcesError>;
+    auto LoadSoundFont(std::string_view path) -> tb::error<sf2::Error>;
     auto SetupMIDIControllerConnection() -> tb::error<usb::Error>;
     void PlayLiveMIDIEvent(const MIDIInputEvent& event);
+    void SelectSynth(size_t index);
+    void Rewind(double seconds);
+    void ChangePlaybackRate(float change);
+    void ToggleLoop();
+    void ToggleMetronome();
     void BeginExercise();
-    void MIDIEnded();
+    void PlayAccompaniment();
+    void CueChanged(const TransportEvent& event);
+    void ReloadResources();
 };
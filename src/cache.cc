@@ -0,0 +1,574 @@
+#include "cache.h"
+
+#include "fileio.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bumped whenever the parser, the structures derived from a parse or the entry
+// layout change, so stale entries are never read
+constexpr uint32_t CACHE_VERSION = 1;
+constexpr char CACHE_MAGIC[4] = { 'W', 'T', 'E', 'C' };
+
+// Entries hold structures as they are in memory, so they are only read back by
+// builds that agree on their sizes
+constexpr uint32_t CACHE_LAYOUT = sizeof(midi::Event) | sizeof(midi::TrackInfo) << 8
+                                | sizeof(midi::NoteInfo) << 16
+                                | sizeof(midi::TempoChange) << 24;
+
+struct SoundingNote
+{
+    midi::NoteInfo info;
+    uint8_t note;
+};
+
+static_assert(std::is_trivially_copyable_v<midi::Event>);
+static_assert(std::is_trivially_copyable_v<midi::TrackInfo>);
+static_assert(std::is_trivially_copyable_v<midi::TempoChange>);
+static_assert(std::is_trivially_copyable_v<midi::Beat>);
+static_assert(std::is_trivially_copyable_v<SoundingNote>);
+
+// Followed by, each aligned to 8 bytes: the event count of every track, every
+// track's events, the tempo changes, the beats, then each checkpoint as a
+// CheckpointRecord with its track states and sounding notes
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t format;
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint64_t content_hash;
+    uint64_t length;
+    uint32_t ticks_per_quarter_note;
+    uint32_t track_count;
+    uint32_t tempo_change_count;
+    uint32_t beat_count;
+    uint32_t checkpoint_count;
+    uint32_t reserved;
+};
+
+struct CheckpointRecord
+{
+    midi::Ticks tick;
+    double seconds;
+    float ticks_per_second;
+    uint32_t track_count;
+    uint32_t note_count;
+    uint32_t reserved;
+};
+
+constexpr size_t SECTION_ALIGNMENT = 8;
+
+struct FileStamp
+{
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+auto HashBytes(std::span<const uint8_t> bytes) -> uint64_t
+{
+    uint64_t hash = 0xCBF29CE484222325;     // FNV-1a
+    for (uint8_t byte : bytes)
+        hash = (hash ^ byte) * 0x100000001B3;
+    return hash;
+}
+
+// Keyed on the absolute path, so the same relative path run from different
+// directories doesn't share an entry
+auto EntryName(std::string_view path) -> std::string
+{
+    std::error_code error;
+    std::string key = std::filesystem::weakly_canonical(path, error).string();
+    if (error) key = path;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016lx.midicache",
+        HashBytes({ reinterpret_cast<const uint8_t*>(key.data()), key.size() }));
+    return name;
+}
+
+class MappedFile
+{
+public:
+    MappedFile(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        if (struct stat info; fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = data;
+                size_ = info.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (data_) munmap(data_, size_);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    auto Bytes() const -> std::span<const uint8_t>
+    {
+        return { static_cast<const uint8_t*>(data_), size_ };
+    }
+
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+class EntryWriter
+{
+public:
+    template<typename T>
+    void Append(std::span<const T> items)
+    {
+        bytes_.resize((bytes_.size() + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1));
+        auto* begin = reinterpret_cast<const uint8_t*>(items.data());
+        bytes_.insert(bytes_.end(), begin, begin + items.size_bytes());
+    }
+
+    template<typename T>
+    void Append(const T& item) { Append(std::span(&item, 1)); }
+
+    auto Finish() -> std::vector<uint8_t> { return std::move(bytes_); }
+
+private:
+    std::vector<uint8_t> bytes_;
+};
+
+// Hands out sections of a mapped entry in the order EntryWriter wrote them,
+// failing rather than reading past the end of a truncated entry
+class EntryReader
+{
+public:
+    EntryReader(std::span<const uint8_t> bytes) : bytes_(bytes) {}
+
+    template<typename T>
+    auto Take(size_t count) -> std::optional<std::span<const T>>
+    {
+        size_t offset = (offset_ + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1);
+        if (offset > bytes_.size() || count > (bytes_.size() - offset) / sizeof(T))
+            return std::nullopt;
+
+        offset_ = offset + count * sizeof(T);
+        return std::span(reinterpret_cast<const T*>(bytes_.data() + offset), count);
+    }
+
+    template<typename T>
+    auto Take() -> const T*
+    {
+        auto items = Take<T>(1);
+        return items ? items->data() : nullptr;
+    }
+
+private:
+    std::span<const uint8_t> bytes_;
+    size_t offset_ = 0;
+};
+
+auto ReadHeader(std::span<const uint8_t> bytes) -> const CacheHeader*
+{
+    const CacheHeader* header = EntryReader(bytes).Take<CacheHeader>();
+    if (header == nullptr || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+        || header->version != CACHE_VERSION || header->layout != CACHE_LAYOUT)
+        return nullptr;
+    return header;
+}
+
+auto Serialize(const midi::MIDI& midi, FileStamp stamp, uint64_t content_hash)
+    -> std::vector<uint8_t>
+{
+    CacheHeader header {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.layout = CACHE_LAYOUT;
+    header.format = static_cast<uint32_t>(midi.format);
+    header.file_size = stamp.size;
+    header.mtime_ns = stamp.mtime_ns;
+    header.content_hash = content_hash;
+    header.length = midi.length;
+    header.ticks_per_quarter_note = midi.ticks_per_quarter_note;
+    header.track_count = midi.tracks.size();
+    header.tempo_change_count = midi.tempo_map.GetChanges().size();
+    header.beat_count = midi.beats.size();
+    header.checkpoint_count = midi.checkpoints.size();
+
+    EntryWriter writer;
+    writer.Append(header);
+
+    std::vector<uint64_t> event_counts;
+    for (const midi::Track& track : midi.tracks)
+        event_counts.push_back(track.events.size());
+    writer.Append(std::span<const uint64_t>(event_counts));
+
+    for (const midi::Track& track : midi.tracks)
+        writer.Append(std::span(track.events));
+
+    writer.Append(midi.tempo_map.GetChanges());
+    writer.Append(std::span(midi.beats));
+
+    std::vector<SoundingNote> notes;
+    for (const midi::Checkpoint& checkpoint : midi.checkpoints) {
+        notes.clear();
+        for (auto& [note, info] : checkpoint.sounding_notes)
+            notes.push_back({ .info = info, .note = note });
+
+        writer.Append(CheckpointRecord {
+            .tick = checkpoint.tick,
+            .seconds = checkpoint.seconds,
+            .ticks_per_second = checkpoint.ticks_per_second,
+            .track_count = static_cast<uint32_t>(checkpoint.tracks.size()),
+            .note_count = static_cast<uint32_t>(notes.size())
+        });
+        writer.Append(std::span(checkpoint.tracks));
+        writer.Append(std::span<const SoundingNote>(notes));
+    }
+
+    return writer.Finish();
+}
+
+// What the parser guarantees and Player indexes by without checking, so a
+// damaged entry that still has the right sizes is rejected instead of read out
+// of bounds
+auto WellFormed(const midi::MIDI& midi) -> bool
+{
+    for (const midi::Track& track : midi.tracks) {
+        if (!track.events.empty() && (track.events.back().type != midi::EventType::META
+            || track.events.back().meta_type != midi::MetaType::END_TRACK))
+            return false;
+    }
+
+    std::span<const midi::TempoChange> changes = midi.tempo_map.GetChanges();
+    if (changes.front().tick != 0 || changes.front().scaled_usec != 0)
+        return false;
+    for (size_t i = 0; i < changes.size(); ++i) {
+        if (changes[i].usec_per_quarter_note == 0)
+            return false;
+        if (i > 0 && (changes[i].tick <= changes[i - 1].tick
+            || changes[i].scaled_usec < changes[i - 1].scaled_usec))
+            return false;
+    }
+
+    for (const midi::Checkpoint& checkpoint : midi.checkpoints) {
+        if (checkpoint.tracks.size() != midi.tracks.size())
+            return false;
+
+        for (size_t i = 0; i < checkpoint.tracks.size(); ++i) {
+            const midi::TrackInfo& info = checkpoint.tracks[i];
+            // Wraps to the first event before any is played
+            if (!info.done && info.current_event_index + 1 >= midi.tracks[i].events.size())
+                return false;
+        }
+
+        for (auto& [note, info] : checkpoint.sounding_notes) {
+            if (note > midi::MAX_NOTE) return false;
+        }
+    }
+
+    return true;
+}
+
+auto Deserialize(std::span<const uint8_t> bytes) -> std::optional<midi::MIDI>
+{
+    EntryReader reader(bytes);
+    const CacheHeader* header = reader.Take<CacheHeader>();
+    auto event_counts = reader.Take<uint64_t>(header->track_count);
+    if (!event_counts) return std::nullopt;
+
+    midi::MIDI midi {
+        .tracks = tb::with_capacity(header->track_count),
+        .format = static_cast<midi::Format>(header->format),
+        .ticks_per_quarter_note = static_cast<uint16_t>(header->ticks_per_quarter_note),
+        .length = header->length
+    };
+
+    for (uint64_t event_count : *event_counts) {
+        auto events = reader.Take<midi::Event>(event_count);
+        if (!events) return std::nullopt;
+        midi.tracks.push_back({ .events = { events->begin(), events->end() } });
+    }
+
+    auto tempo_changes = reader.Take<midi::TempoChange>(header->tempo_change_count);
+    auto beats = reader.Take<midi::Beat>(header->beat_count);
+    if (!tempo_changes || tempo_changes->empty() || !beats) return std::nullopt;
+
+    midi.tempo_map = midi::TempoMap({ tempo_changes->begin(), tempo_changes->end() },
+        midi.ticks_per_quarter_note);
+    midi.beats.assign(beats->begin(), beats->end());
+
+    midi.checkpoints.reserve(header->checkpoint_count);
+    for (uint32_t i = 0; i < header->checkpoint_count; ++i) {
+        const CheckpointRecord* record = reader.Take<CheckpointRecord>();
+        if (record == nullptr) return std::nullopt;
+
+        auto tracks = reader.Take<midi::TrackInfo>(record->track_count);
+        auto notes = reader.Take<SoundingNote>(record->note_count);
+        if (!tracks || !notes) return std::nullopt;
+
+        midi::Checkpoint& checkpoint = midi.checkpoints.emplace_back(midi::Checkpoint {
+            .tick = record->tick,
+            .tracks = { tracks->begin(), tracks->end() },
+            .ticks_per_second = record->ticks_per_second,
+            .seconds = record->seconds
+        });
+        for (const SoundingNote& note : *notes)
+            checkpoint.sounding_notes.emplace_back(note.note, note.info);
+    }
+
+    if (!WellFormed(midi)) return std::nullopt;
+    return midi;
+}
+
+auto ReadFile(const std::string& path) -> std::optional<std::vector<uint8_t>>
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) return std::nullopt;
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[65536];
+    for (size_t count; (count = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+        bytes.insert(bytes.end(), buffer, buffer + count);
+
+    if (ferror(file)) return std::nullopt;
+    return bytes;
+}
+
+MIDICache::MIDICache(std::string directory) : directory_(std::move(directory)) {}
+
+MIDICache::~MIDICache()
+{
+    {
+        std::lock_guard guard(lock_);
+        stopping_ = true;
+    }
+    pending_changed_.notify_one();
+
+    BeginWriting();
+    writer_.join();
+}
+
+auto LoadMIDIFile(std::string_view path, uint64_t& content_hash)
+    -> tb::result<midi::MIDI, midi::Error>
+{
+    std::optional<std::vector<uint8_t>> contents = ReadFile(std::string(path));
+    if (!contents)
+        return midi::Error { midi::Error::FILE_NOT_FOUND };
+
+    content_hash = HashBytes(*contents);
+    return midi::MIDI::FromMemory(*contents);
+}
+
+auto LoadMIDIFiles(std::span<const std::string> paths, std::span<uint64_t> content_hashes)
+    -> std::vector<tb::result<midi::MIDI, midi::Error>>
+{
+    std::vector<fileio::FileContents> contents = fileio::ReadFiles(paths);
+    std::vector<tb::result<midi::MIDI, midi::Error>> midis = tb::with_capacity(paths.size());
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (contents[i].info.error != 0) {
+            midis.push_back(midi::Error { midi::Error::FILE_NOT_FOUND });
+            continue;
+        }
+
+        content_hashes[i] = HashBytes(contents[i].bytes);
+        midis.push_back(midi::MIDI::FromMemory(contents[i].bytes));
+    }
+
+    return midis;
+}
+
+auto ToStamp(const fileio::FileInfo& info) -> FileStamp
+{
+    return { .size = info.size, .mtime_ns = info.mtime_ns };
+}
+
+auto MIDICache::Load(std::string_view path, uint64_t& content_hash)
+    -> tb::result<midi::MIDI, midi::Error>
+{
+    std::string source(path);
+
+    struct stat source_info;
+    if (stat(source.c_str(), &source_info) != 0)
+        return midi::Error { midi::Error::FILE_NOT_FOUND };
+
+    const FileStamp stamp {
+        .size = static_cast<uint64_t>(source_info.st_size),
+        .mtime_ns = source_info.st_mtim.tv_sec * 1000000000ll + source_info.st_mtim.tv_nsec
+    };
+
+    std::string entry_path = directory_ + "/" + EntryName(source);
+    if (std::optional<midi::MIDI> midi = LoadEntry(entry_path, stamp, content_hash))
+        return std::move(*midi);
+
+    std::optional<std::vector<uint8_t>> contents = ReadFile(source);
+    if (!contents)
+        return midi::Error { midi::Error::FILE_NOT_FOUND };
+
+    return LoadContents(std::move(entry_path), stamp, *contents, content_hash);
+}
+
+// Sources are stat'ed in one batch, and those without a valid entry are read in
+// a second
+auto MIDICache::LoadMany(std::span<const std::string> paths,
+        std::span<uint64_t> content_hashes)
+    -> std::vector<tb::result<midi::MIDI, midi::Error>>
+{
+    std::vector<fileio::FileInfo> infos = fileio::StatFiles(paths);
+    std::vector<std::optional<tb::result<midi::MIDI, midi::Error>>> midis(paths.size());
+    std::vector<std::string> misses;
+    std::vector<size_t> miss_indices;
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (infos[i].error != 0) {
+            midis[i] = midi::Error { midi::Error::FILE_NOT_FOUND };
+        } else if (auto midi = LoadEntry(directory_ + "/" + EntryName(paths[i]),
+                ToStamp(infos[i]), content_hashes[i])) {
+            midis[i] = std::move(*midi);
+        } else {
+            misses.push_back(paths[i]);
+            miss_indices.push_back(i);
+        }
+    }
+
+    std::vector<fileio::FileContents> contents = fileio::ReadFiles(misses);
+    for (size_t miss = 0; miss < misses.size(); ++miss) {
+        size_t i = miss_indices[miss];
+        if (contents[miss].info.error != 0) {
+            midis[i] = midi::Error { midi::Error::FILE_NOT_FOUND };
+            continue;
+        }
+
+        midis[i] = LoadContents(directory_ + "/" + EntryName(paths[i]),
+            ToStamp(contents[miss].info), contents[miss].bytes, content_hashes[i]);
+    }
+
+    std::vector<tb::result<midi::MIDI, midi::Error>> results = tb::with_capacity(paths.size());
+    for (auto& midi : midis)
+        results.push_back(std::move(*midi));
+    return results;
+}
+
+// Warm start: the source isn't even opened
+auto MIDICache::LoadEntry(const std::string& entry_path, FileStamp stamp,
+        uint64_t& content_hash) -> std::optional<midi::MIDI>
+{
+    MappedFile entry(entry_path);
+    const CacheHeader* header = ReadHeader(entry.Bytes());
+
+    if (header && header->file_size == stamp.size && header->mtime_ns == stamp.mtime_ns) {
+        if (std::optional<midi::MIDI> midi = Deserialize(entry.Bytes())) {
+            content_hash = header->content_hash;
+            return midi;
+        }
+    }
+
+    return std::nullopt;
+}
+
+auto MIDICache::LoadContents(std::string entry_path, FileStamp stamp,
+        std::span<const uint8_t> contents, uint64_t& content_hash)
+    -> tb::result<midi::MIDI, midi::Error>
+{
+    content_hash = HashBytes(contents);
+
+    // Touched or copied but not changed, so only the stamp needs refreshing
+    MappedFile entry(entry_path);
+    const CacheHeader* header = ReadHeader(entry.Bytes());
+    if (header && header->content_hash == content_hash) {
+        if (std::optional<midi::MIDI> midi = Deserialize(entry.Bytes())) {
+            std::vector<uint8_t> bytes(entry.Bytes().begin(), entry.Bytes().end());
+            auto* restamped = reinterpret_cast<CacheHeader*>(bytes.data());
+            restamped->file_size = stamp.size;
+            restamped->mtime_ns = stamp.mtime_ns;
+            Store(std::move(entry_path), std::move(bytes));
+            return std::move(*midi);
+        }
+    }
+
+    auto midi = midi::MIDI::FromMemory(contents);
+    if (midi.is_error())
+        return midi.get_error();
+
+    Store(std::move(entry_path), Serialize(midi.get_unchecked(), stamp, content_hash));
+    return std::move(midi.get_mut_unchecked());
+}
+
+void MIDICache::BeginWriting()
+{
+    if (!writer_.joinable())
+        writer_ = std::thread([this] { WritePending(); });
+}
+
+void MIDICache::Store(std::string entry_path, std::vector<uint8_t> bytes)
+{
+    {
+        std::lock_guard guard(lock_);
+        pending_.push_back({ std::move(entry_path), std::move(bytes) });
+    }
+    pending_changed_.notify_one();
+}
+
+// Entries are written under a temporary name and renamed into place, so a
+// crash or a second instance never leaves a partial entry to be read
+void MIDICache::WritePending()
+{
+    std::unique_lock guard(lock_);
+
+    while (true) {
+        pending_changed_.wait(guard, [this] { return stopping_ || !pending_.empty(); });
+        if (pending_.empty()) break;
+
+        std::vector<PendingWrite> writes = std::move(pending_);
+        pending_.clear();
+        guard.unlock();
+
+        std::error_code error;
+        std::filesystem::create_directories(directory_, error);
+
+        for (const PendingWrite& write : writes) {
+            std::string temporary_path = write.entry_path + ".tmp" + std::to_string(getpid());
+
+            FILE* file = fopen(temporary_path.c_str(), "wb");
+            if (file == nullptr) continue;
+
+            bool written = fwrite(write.bytes.data(), 1, write.bytes.size(), file)
+                           == write.bytes.size();
+            written = fclose(file) == 0 && written;
+
+            if (!written || rename(temporary_path.c_str(), write.entry_path.c_str()) != 0)
+                unlink(temporary_path.c_str());
+        }
+
+        guard.lock();
+    }
+}
+
+auto DefaultCacheDirectory() -> std::string
+{
+    if (const char* directory = std::getenv("WTE_CACHE_DIR"))
+        return directory;
+    if (const char* cache_home = std::getenv("XDG_CACHE_HOME"); cache_home && *cache_home)
+        return std::string(cache_home) + "/well-tempered-ear";
+    if (const char* home = std::getenv("HOME"))
+        return std::string(home) + "/.cache/well-tempered-ear";
+    return {};
+}
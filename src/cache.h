@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "midi.h"
+
+#include <tb/tb.h>
+
+struct FileStamp;
+
+// Parsed MIDIs kept on disk between runs, so unchanged files are loaded with a
+// few bulk copies instead of being parsed and replayed. Each source path has
+// one entry, valid while the file's size and modification time match, or
+// failing that while its contents hash the same. Entries are flat and are read
+// through mmap. New entries are written by a background thread once
+// BeginWriting is called, so writing doesn't slow startup.
+class MIDICache
+{
+public:
+    MIDICache(std::string directory);
+    ~MIDICache();   // Finishes any pending writes
+
+    MIDICache(const MIDICache&) = delete;
+    MIDICache& operator=(const MIDICache&) = delete;
+
+    // Loads from the cache, or parses the file and queues an entry for it. Also
+    // gives the hash of the file's contents.
+    auto Load(std::string_view path, uint64_t& content_hash)
+        -> tb::result<midi::MIDI, midi::Error>;
+    // Load for many files at once, in the order given
+    auto LoadMany(std::span<const std::string> paths, std::span<uint64_t> content_hashes)
+        -> std::vector<tb::result<midi::MIDI, midi::Error>>;
+    void BeginWriting();
+
+private:
+    struct PendingWrite
+    {
+        std::string entry_path;
+        std::vector<uint8_t> bytes;
+    };
+
+    auto LoadEntry(const std::string& entry_path, FileStamp stamp, uint64_t& content_hash)
+        -> std::optional<midi::MIDI>;
+    auto LoadContents(std::string entry_path, FileStamp stamp,
+        std::span<const uint8_t> contents, uint64_t& content_hash)
+        -> tb::result<midi::MIDI, midi::Error>;
+    void Store(std::string entry_path, std::vector<uint8_t> bytes);
+    void WritePending();
+
+    std::string directory_;
+    std::mutex lock_;
+    std::condition_variable pending_changed_;
+    std::vector<PendingWrite> pending_;
+    std::thread writer_;
+    bool stopping_ = false;
+};
+
+// Parse files without the cache, hashing their contents as Load does
+auto LoadMIDIFile(std::string_view path, uint64_t& content_hash)
+    -> tb::result<midi::MIDI, midi::Error>;
+auto LoadMIDIFiles(std::span<const std::string> paths, std::span<uint64_t> content_hashes)
+    -> std::vector<tb::result<midi::MIDI, midi::Error>>;
+
+// FNV-1a, which identifies a MIDI by its contents
+auto HashBytes(std::span<const uint8_t> bytes) -> uint64_t;
+
+// Where the cache lives unless WTE_CACHE_DIR says otherwise, following the XDG
+// base directory convention
+auto DefaultCacheDirectory() -> std::string;
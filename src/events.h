@@ -24,8 +24,20 @@ struct MIDIInputEvent
     uint8_t note, velocity, channel;
 };
 
-struct MIDIPlayerEndEvent
+enum class CueState { STARTED, ENDED };
+
+// Sent from the audio thread as file playback moves through its queued cues
+struct TransportEvent
+{
+    const static inline uint32_t EVENT_NUMBER = NextAvailableEventNumber();
+    const SDL_CommonEvent base_event = BaseEvent<TransportEvent>();
+    uint32_t tag;
+    CueState state;
+};
+
+// Sent from the resource watcher once changed files have been re-read
+struct ResourcesChangedEvent
 {
     const static inline uint32_t EVENT_NUMBER = NextAvailableEventNumber();
-    const SDL_CommonEvent base_event = BaseEvent<MIDIPlayerEndEvent>();
+    const SDL_CommonEvent base_event = BaseEvent<ResourcesChangedEvent>();
 };
@@ -0,0 +1,486 @@
+#include "fileio.h"
+
+#include <tb/tb.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace fileio
+{
+
+// Submission entries per ring, so also how many requests are in flight at once
+constexpr unsigned RING_ENTRIES = 256;
+
+// Reads larger than this finish with ordinary syscalls, as a request's length
+// is 32 bits
+constexpr uint64_t MAX_RING_READ = 1 << 30;
+
+constexpr uint8_t REQUIRED_OPS[] = {
+    IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE
+};
+
+auto ToNanoseconds(int64_t seconds, uint32_t nanoseconds) -> int64_t
+{
+    return seconds * 1000000000ll + nanoseconds;
+}
+
+// A minimal io_uring over the raw syscalls, for one thread. Requests are
+// queued with Queue, then Wait submits them and hands every completion to a
+// callback until the given number have arrived. A ring that fails once is
+// given up on for good.
+class Ring
+{
+public:
+    Ring(unsigned entries)
+    {
+        io_uring_params params {};
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) return;
+
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+        sq_ = Map(sq_size_, IORING_OFF_SQ_RING);
+        cq_ = single_mmap ? sq_ : Map(cq_size_, IORING_OFF_CQ_RING);
+        sqes_ = static_cast<io_uring_sqe*>(Map(sqes_size_, IORING_OFF_SQES));
+        if (!sq_ || !cq_ || !sqes_) return;
+
+        auto* sq = static_cast<char*>(sq_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        auto* cq = static_cast<char*>(cq_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        tail_ = *sq_tail_;
+        reaped_ = *sq_head_;
+        supported_ = SupportsRequiredOps();
+    }
+
+    ~Ring()
+    {
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (cq_ && cq_ != sq_) munmap(cq_, cq_size_);
+        if (sq_) munmap(sq_, sq_size_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    // False when the kernel lacks io_uring, or the operations used here
+    auto Supported() const -> bool
+    {
+        return supported_;
+    }
+
+    auto Queue(uint8_t opcode, int fd, uint64_t user_data) -> io_uring_sqe&
+    {
+        unsigned index = tail_++ & sq_mask_;
+        io_uring_sqe& sqe = sqes_[index];
+        sqe = {};
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.user_data = user_data;
+        sq_array_[index] = index;
+        return sqe;
+    }
+
+    // On failure, every request the kernel took has still completed, so none
+    // can write into the caller's buffers once this returns
+    template<typename Fn>
+    auto Wait(unsigned count, const Fn& on_completion) -> bool
+    {
+        std::atomic_ref(*sq_tail_).store(tail_, std::memory_order_release);
+
+        while (count > 0) {
+            unsigned unsubmitted = tail_
+                - std::atomic_ref(*sq_head_).load(std::memory_order_acquire);
+            long result = syscall(__NR_io_uring_enter, fd_, unsubmitted, 1,
+                IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                Abandon(on_completion);
+                return false;
+            }
+
+            count -= Reap(count, on_completion);
+        }
+
+        return true;
+    }
+
+private:
+    template<typename Fn>
+    auto Reap(unsigned max_count, const Fn& on_completion) -> unsigned
+    {
+        unsigned head = *cq_head_;
+        unsigned tail = std::atomic_ref(*cq_tail_).load(std::memory_order_acquire);
+        unsigned count = 0;
+        for (; head != tail && count < max_count; ++head, ++count)
+            on_completion(cqes_[head & cq_mask_]);
+
+        std::atomic_ref(*cq_head_).store(head, std::memory_order_release);
+        reaped_ += count;
+        return count;
+    }
+
+    // Waits out whatever the kernel has taken, passing the completions on as
+    // usual. Requests never submitted are left in the queue, as the ring is
+    // never entered again.
+    template<typename Fn>
+    void Abandon(const Fn& on_completion)
+    {
+        supported_ = false;
+
+        while (reaped_ != std::atomic_ref(*sq_head_).load(std::memory_order_acquire)) {
+            long result = syscall(__NR_io_uring_enter, fd_, 0, 1,
+                IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (result < 0 && errno != EINTR)
+                sched_yield();
+
+            Reap(std::numeric_limits<unsigned>::max(), on_completion);
+        }
+    }
+
+    auto Map(size_t size, off_t offset) -> void*
+    {
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return data != MAP_FAILED ? data : nullptr;
+    }
+
+    auto SupportsRequiredOps() const -> bool
+    {
+        constexpr unsigned PROBE_OPS = 256;
+        size_t size = sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op);
+        auto buffer = std::make_unique<uint8_t[]>(size);
+        auto* probe = reinterpret_cast<io_uring_probe*>(buffer.get());
+
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0)
+            return false;
+
+        return std::ranges::all_of(REQUIRED_OPS, [probe] (uint8_t op) {
+            return op <= probe->last_op
+                && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        });
+    }
+
+    int fd_ = -1;
+    void* sq_ = nullptr;
+    void* cq_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sq_size_ = 0, cq_size_ = 0, sqes_size_ = 0;
+    unsigned *sq_head_ = nullptr, *sq_tail_ = nullptr, *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr;
+    unsigned sq_mask_ = 0, cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned tail_ = 0;
+    unsigned reaped_ = 0;   // Completions taken, to compare with requests submitted
+    bool supported_ = false;
+};
+
+enum class RingPolicy { NEVER, NETWORK_FILESYSTEMS, ALWAYS };
+
+auto GetRingPolicy() -> RingPolicy
+{
+    static const RingPolicy policy = [] {
+        const char* setting = std::getenv("WTE_IO_URING");
+        if (setting && *setting == '0')
+            return RingPolicy::NEVER;
+        if (!Ring(1).Supported())
+            return RingPolicy::NEVER;
+        if (setting && *setting == '1')
+            return RingPolicy::ALWAYS;
+        return RingPolicy::NETWORK_FILESYSTEMS;
+    }();
+    return policy;
+}
+
+// Local files the page cache already holds are read faster with ordinary
+// syscalls, as a ring hands stats off to kernel worker threads. Queueing pays
+// off where every request is a round trip to a server.
+auto OnNetworkFilesystem(const std::string& path) -> bool
+{
+    constexpr long NETWORK_FILESYSTEMS[] = {
+        0x6969,         // NFS
+        0x517B,         // SMB
+        0xFF534D42,     // CIFS
+        0xFE534D42,     // SMB2
+        0x65735546,     // FUSE, including sshfs
+        0x00C36400,     // Ceph
+        0x5346414F,     // AFS
+        0x01021997,     // 9P
+    };
+
+    struct statfs info;
+    if (statfs(path.c_str(), &info) != 0)
+        return false;
+
+    return std::ranges::find(NETWORK_FILESYSTEMS, static_cast<long>(info.f_type))
+        != std::end(NETWORK_FILESYSTEMS);
+}
+
+// Kept for the thread's lifetime, as tearing a ring down stops its kernel
+// worker threads, which the next batch would only start again. Batches are
+// judged by their first file, as a library rarely spans filesystems.
+auto RingFor(std::span<const std::string> paths) -> Ring*
+{
+    // A single file has nothing to batch
+    if (paths.size() < 2)
+        return nullptr;
+
+    switch (GetRingPolicy()) {
+    case RingPolicy::NEVER:
+        return nullptr;
+    case RingPolicy::NETWORK_FILESYSTEMS:
+        if (!OnNetworkFilesystem(paths[0]))
+            return nullptr;
+        break;
+    case RingPolicy::ALWAYS:
+        break;
+    }
+
+    thread_local Ring ring(RING_ENTRIES);
+    return ring.Supported() ? &ring : nullptr;
+}
+
+auto Backend(std::span<const std::string> paths) -> std::string_view
+{
+    return RingFor(paths) ? "io_uring" : "syscalls";
+}
+
+// Reads from offset to the end, allowing for the file having shrunk
+auto ReadRemaining(int fd, std::vector<uint8_t>& bytes, size_t offset) -> int
+{
+    while (offset < bytes.size()) {
+        ssize_t count = pread(fd, bytes.data() + offset, bytes.size() - offset, offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return errno;
+        if (count == 0)
+            break;
+        offset += count;
+    }
+
+    bytes.resize(offset);
+    return 0;
+}
+
+auto StatFile(const std::string& path) -> FileInfo
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return { .error = errno };
+
+    return {
+        .size = static_cast<uint64_t>(info.st_size),
+        .mtime_ns = ToNanoseconds(info.st_mtim.tv_sec, info.st_mtim.tv_nsec)
+    };
+}
+
+auto ReadFile(const std::string& path) -> FileContents
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return { .info = { .error = errno } };
+
+    tb::scoped_guard close_file = [fd] { close(fd); };
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+        return { .info = { .error = errno } };
+
+    FileContents contents {
+        .info = {
+            .size = static_cast<uint64_t>(info.st_size),
+            .mtime_ns = ToNanoseconds(info.st_mtim.tv_sec, info.st_mtim.tv_nsec)
+        }
+    };
+    contents.bytes.resize(contents.info.size);
+    contents.info.error = ReadRemaining(fd, contents.bytes, 0);
+    return contents;
+}
+
+auto StatFilesRing(Ring& ring, std::span<const std::string> paths,
+        std::vector<FileInfo>& infos) -> bool
+{
+    std::vector<struct statx> stats(paths.size());
+
+    for (size_t first = 0; first < paths.size(); first += RING_ENTRIES) {
+        size_t last = std::min(paths.size(), first + RING_ENTRIES);
+
+        for (size_t i = first; i < last; ++i) {
+            io_uring_sqe& sqe = ring.Queue(IORING_OP_STATX, AT_FDCWD, i);
+            sqe.addr = reinterpret_cast<uint64_t>(paths[i].c_str());
+            sqe.len = STATX_SIZE | STATX_MTIME;
+            sqe.off = reinterpret_cast<uint64_t>(&stats[i]);
+        }
+
+        bool okay = ring.Wait(last - first, [&] (const io_uring_cqe& cqe) {
+            const struct statx& stat = stats[cqe.user_data];
+            FileInfo& info = infos[cqe.user_data];
+            if (cqe.res < 0) {
+                info.error = -cqe.res;
+                return;
+            }
+            info.size = stat.stx_size;
+            info.mtime_ns = ToNanoseconds(stat.stx_mtime.tv_sec, stat.stx_mtime.tv_nsec);
+        });
+        if (!okay) return false;
+    }
+
+    return true;
+}
+
+// In three phases across the batch: every open, then every read, then every
+// close. Sizes come from fstat on the open descriptors, which needs no I/O,
+// where a statx request would be handed to a kernel worker thread. Returns
+// false if the ring stopped working partway.
+auto ReadFilesRing(Ring& ring, std::span<const std::string> paths,
+        std::vector<FileContents>& contents) -> bool
+{
+    std::vector<int> fds(paths.size(), -1);
+    std::vector<size_t> read_sizes(paths.size(), 0);
+
+    tb::scoped_guard close_remaining = [&fds] {
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+    };
+
+    for (size_t first = 0; first < paths.size(); first += RING_ENTRIES) {
+        size_t last = std::min(paths.size(), first + RING_ENTRIES);
+
+        for (size_t i = first; i < last; ++i) {
+            io_uring_sqe& open = ring.Queue(IORING_OP_OPENAT, AT_FDCWD, i);
+            open.addr = reinterpret_cast<uint64_t>(paths[i].c_str());
+            open.open_flags = O_RDONLY | O_CLOEXEC;
+        }
+
+        bool okay = ring.Wait(last - first, [&] (const io_uring_cqe& cqe) {
+            if (cqe.res < 0)
+                contents[cqe.user_data].info.error = -cqe.res;
+            else
+                fds[cqe.user_data] = cqe.res;
+        });
+        if (!okay) return false;
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        struct stat info;
+        if (fds[i] < 0) continue;
+        if (fstat(fds[i], &info) != 0) {
+            contents[i].info.error = errno;
+            continue;
+        }
+
+        contents[i].info.size = info.st_size;
+        contents[i].info.mtime_ns = ToNanoseconds(info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+    }
+
+    std::vector<size_t> to_read;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (fds[i] < 0 || contents[i].info.error != 0 || contents[i].info.size == 0)
+            continue;
+        contents[i].bytes.resize(contents[i].info.size);
+        to_read.push_back(i);
+    }
+
+    for (size_t first = 0; first < to_read.size(); first += RING_ENTRIES) {
+        size_t last = std::min(to_read.size(), first + RING_ENTRIES);
+
+        for (size_t i : std::span(to_read).subspan(first, last - first)) {
+            io_uring_sqe& read = ring.Queue(IORING_OP_READ, fds[i], i);
+            read.addr = reinterpret_cast<uint64_t>(contents[i].bytes.data());
+            read.len = static_cast<uint32_t>(std::min(contents[i].info.size, MAX_RING_READ));
+            read.off = 0;
+        }
+
+        bool okay = ring.Wait(last - first, [&] (const io_uring_cqe& cqe) {
+            if (cqe.res < 0)
+                contents[cqe.user_data].info.error = -cqe.res;
+            else
+                read_sizes[cqe.user_data] = cqe.res;
+        });
+        if (!okay) return false;
+    }
+
+    // Short reads are rare enough to finish one at a time
+    for (size_t i : to_read) {
+        FileContents& file = contents[i];
+        if (file.info.error == 0 && read_sizes[i] < file.bytes.size())
+            file.info.error = ReadRemaining(fds[i], file.bytes, read_sizes[i]);
+    }
+
+    // Descriptors are forgotten as their closes complete, so any the ring never
+    // got to are left for close_remaining
+    auto closed = [&fds] (const io_uring_cqe& cqe) { fds[cqe.user_data] = -1; };
+
+    unsigned close_count = 0;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (fds[i] < 0) continue;
+
+        ring.Queue(IORING_OP_CLOSE, fds[i], i);
+        if (++close_count == RING_ENTRIES) {
+            if (!ring.Wait(close_count, closed)) return false;
+            close_count = 0;
+        }
+    }
+
+    return ring.Wait(close_count, closed);
+}
+
+auto StatFiles(std::span<const std::string> paths) -> std::vector<FileInfo>
+{
+    std::vector<FileInfo> infos(paths.size());
+
+    // A single file has nothing to batch
+    if (Ring* ring = RingFor(paths)) {
+        if (StatFilesRing(*ring, paths, infos))
+            return infos;
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i)
+        infos[i] = StatFile(paths[i]);
+    return infos;
+}
+
+auto ReadFiles(std::span<const std::string> paths) -> std::vector<FileContents>
+{
+    std::vector<FileContents> contents(paths.size());
+
+    if (Ring* ring = RingFor(paths)) {
+        if (ReadFilesRing(*ring, paths, contents))
+            return contents;
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i)
+        contents[i] = ReadFile(paths[i]);
+    return contents;
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Stats and reads of many files at once. For files on network filesystems, the
+// opens, stats, reads and closes of a whole batch are queued through io_uring,
+// so a library of small files waits on a few round trips to the server rather
+// than several per file. Local files, and kernels or sandboxes without
+// io_uring, get the same results through ordinary syscalls. WTE_IO_URING=1
+// queues every batch through io_uring, and WTE_IO_URING=0 none.
+namespace fileio
+{
+
+struct FileInfo
+{
+    int error = 0;          // errno, or 0 on success
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+};
+
+struct FileContents
+{
+    FileInfo info;
+    std::vector<uint8_t> bytes;
+};
+
+// Results are in the order of the paths
+auto StatFiles(std::span<const std::string> paths) -> std::vector<FileInfo>;
+auto ReadFiles(std::span<const std::string> paths) -> std::vector<FileContents>;
+
+// "io_uring" or "syscalls", whichever would load these paths
+auto Backend(std::span<const std::string> paths) -> std::string_view;
+
+}
@@ -1,8 +1,13 @@
 #include "game.h"
 
+#include "fileio.h"
+
+#include <filesystem>
 #include <type_traits>
 #include <random>
 
+#include <sys/stat.h>
+
 template<size_t MAX_LENGTH, auto Predicate>
 struct Token
 {
@@ -68,26 +73,11 @@ auto TypedRead(tb::type_tag_t<EnumName<E>>, Stream stream)
     return EnumName<E> { *value };
 }
 
-auto Resources::LoadMIDI(std::string_view path)
--> tb::result<MIDIIndex, midi::Error>
-{
-    auto midi_or_err = midi::MIDI::FromFile(path);
-    if (midi_or_err.is_error())
-        return midi_or_err.get_error();
-
-    midis.emplace_back(std::move(midi_or_err.get_mut_unchecked()));
-    return static_cast<MIDIIndex>(midis.size() - 1);
-}
-
-auto Resources::LoadExercises(std::string_view path) -> tb::error<LoadExercisesError>
+auto ParseExerciseManifest(FILE* file)
+    -> tb::result<std::vector<ExerciseEntry>, LoadExercisesError>
 {
-    FILE* file = fopen(path.data(), "r");
-    if (file == nullptr)
-        return LoadExercisesError { LoadExercisesError::EXERCISES_NOT_FOUND };
-
-    tb::scoped_guard close_file = [file] { fclose(file); };
-
     Stream stream(file);
+    std::vector<ExerciseEntry> entries;
 
     while (!feof(file)) {
         auto result = stream.Read(tb::type_tag<
@@ -106,31 +96,363 @@ auto Resources::LoadExercises(std::string_view path) -> tb::error<LoadExercisesE
 
         auto& [path, type, tonality, difficulty] = result.get_unchecked();
 
-        auto midi_index = LoadMIDI(std::string_view { path.value.data() });
-
-        if (midi_index.is_error()) {
-            midi::Error err = midi_index.get_error();
-            if (err.type == midi::Error::FILE_NOT_FOUND)
-                return LoadExercisesError { LoadExercisesError::MIDI_NOT_FOUND };
-
-            return LoadExercisesError { LoadExercisesError::MIDI_ERROR };
-        }
-
-        exercises.emplace_back(Exercise {
-            .midi = midi_index.get_unchecked(),
+        entries.push_back({
+            .path = path.value.data(),
             .type = type.value,
             .tonality = tonality.value,
             .difficulty = difficulty.value
         });
     }
 
-    if (exercises.empty())
+    if (entries.empty())
         return LoadExercisesError { LoadExercisesError::EXERCISES_NOT_FOUND };
 
+    return entries;
+}
+
+auto ParseExerciseManifest(std::string_view path)
+    -> tb::result<std::vector<ExerciseEntry>, LoadExercisesError>
+{
+    FILE* file = fopen(std::string(path).c_str(), "r");
+    if (file == nullptr)
+        return LoadExercisesError { LoadExercisesError::EXERCISES_NOT_FOUND };
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+    return ParseExerciseManifest(file);
+}
+
+auto ParseExerciseManifest(std::span<const uint8_t> contents)
+    -> tb::result<std::vector<ExerciseEntry>, LoadExercisesError>
+{
+    if (contents.empty())
+        return LoadExercisesError { LoadExercisesError::EXERCISES_NOT_FOUND };
+
+    FILE* file = fmemopen(const_cast<uint8_t*>(contents.data()), contents.size(), "r");
+    if (file == nullptr)
+        return LoadExercisesError { LoadExercisesError::EXERCISES_NOT_FOUND };
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+    return ParseExerciseManifest(file);
+}
+
+auto LoadMIDIBody(MIDICache* cache, const std::string& path) -> LoadedMIDI
+{
+    uint64_t content_hash = 0;
+    auto midi = cache ? cache->Load(path, content_hash) : LoadMIDIFile(path, content_hash);
+    return { .midi = std::move(midi), .content_hash = content_hash };
+}
+
+auto LoadMIDIBody(const pack::ResourcePack* pack, MIDICache* cache,
+        const std::string& path) -> LoadedMIDI
+{
+    if (!pack || !pack->Contains(path))
+        return LoadMIDIBody(cache, path);
+
+    uint64_t content_hash = 0;
+    auto midi = pack->LoadMIDI(path, content_hash);
+    return { .midi = std::move(midi), .content_hash = content_hash };
+}
+
+auto LoadMIDIBodies(MIDICache* cache, std::span<const std::string> paths)
+    -> std::vector<LoadedMIDI>
+{
+    std::vector<uint64_t> content_hashes(paths.size(), 0);
+    auto midis = cache ? cache->LoadMany(paths, content_hashes)
+                       : LoadMIDIFiles(paths, content_hashes);
+
+    std::vector<LoadedMIDI> loaded = tb::with_capacity(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+        loaded.push_back({ .midi = std::move(midis[i]), .content_hash = content_hashes[i] });
+    return loaded;
+}
+
+auto Resources::LoadMIDI(std::string_view path)
+-> tb::result<MIDIIndex, midi::Error>
+{
+    std::string normal_path = std::filesystem::path(path).lexically_normal();
+
+    if (!midi_paths_.contains(normal_path) && !(pack && pack->Contains(normal_path))) {
+        if (struct stat info; stat(normal_path.c_str(), &info) != 0)
+            return midi::Error { midi::Error::FILE_NOT_FOUND };
+    }
+
+    return Register(std::move(normal_path));
+}
+
+auto Resources::AddMIDI(midi::MIDI midi) -> MIDIIndex
+{
+    auto index = static_cast<MIDIIndex>(midi_slots_.size());
+    MIDISlot& slot = midi_slots_.emplace_back();
+    slot.memory_usage = midi.MemoryUsage();
+    slot.midi = std::make_shared<const midi::MIDI>(std::move(midi));
+
+    resident_memory_ += slot.memory_usage;
+    slot.lru_position = lru_.insert(lru_.begin(), index);
+    return index;
+}
+
+auto Resources::LoadExercises(std::string_view path) -> tb::error<LoadExercisesError>
+{
+    if (pack) {
+        auto manifest = pack->ReadManifest();
+        if (manifest.is_error())
+            return LoadExercisesError { LoadExercisesError::EXERCISES_NOT_FOUND };
+
+        auto entries = ParseExerciseManifest(manifest.get_unchecked());
+        if (entries.is_error())
+            return entries.get_error();
+
+        return SetExercises(entries.get_unchecked());
+    }
+
+    auto entries = ParseExerciseManifest(path);
+    if (entries.is_error())
+        return entries.get_error();
+
+    return SetExercises(entries.get_unchecked());
+}
+
+// Registers every entry's MIDI before replacing the exercises, so a bad
+// manifest leaves the current exercises as they were
+auto Resources::SetExercises(std::span<const ExerciseEntry> entries)
+    -> tb::error<LoadExercisesError>
+{
+    std::vector<std::string> paths = tb::with_capacity(entries.size());
+    std::vector<std::string> unseen_paths;
+
+    for (const ExerciseEntry& entry : entries) {
+        std::string& path = paths.emplace_back(
+            std::filesystem::path(entry.path).lexically_normal());
+        if (!midi_paths_.contains(path) && !(pack && pack->Contains(path)))
+            unseen_paths.push_back(path);
+    }
+
+    // New files are checked for in one batch, which for a large library on a
+    // network filesystem saves a round trip per file
+    std::vector<fileio::FileInfo> infos = fileio::StatFiles(unseen_paths);
+    for (size_t i = 0; i < unseen_paths.size(); ++i) {
+        if (infos[i].error != 0)
+            return LoadExercisesError { LoadExercisesError::MIDI_NOT_FOUND };
+    }
+
+    for (MIDISlot& slot : midi_slots_)
+        slot.manifest_references = 0;
+
+    std::vector<Exercise> new_exercises = tb::with_capacity(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        MIDIIndex index = Register(std::move(paths[i]));
+        ++midi_slots_[index].manifest_references;
+
+        new_exercises.push_back({
+            .midi = index,
+            .type = entries[i].type,
+            .tonality = entries[i].tonality,
+            .difficulty = entries[i].difficulty
+        });
+    }
+
+    exercises = std::move(new_exercises);
+    return tb::ok;
+}
+
+auto Resources::GetMIDIPaths() const -> std::vector<std::string>
+{
+    std::vector<std::string> paths;
+    for (const auto& [path, index] : midi_paths_)
+        paths.push_back(path);
+    return paths;
+}
+
+auto Resources::GetMIDI(MIDIIndex index) -> tb::result<SharedMIDI, midi::Error>
+{
+    index = Resolve(index);
+    MIDISlot& slot = midi_slots_[index];
+
+    if (slot.midi) {
+        lru_.splice(lru_.begin(), lru_, slot.lru_position);
+        return slot.midi;
+    }
+
+    return Adopt(index, Load(index));
+}
+
+void Resources::Prefetch(MIDIIndex index)
+{
+    index = Resolve(index);
+    if (midi_slots_[index].midi || (prefetch_ && prefetch_->index == index))
+        return;
+
+    // Only one load runs in the background, so one no longer wanted is waited
+    // for and dropped
+    prefetch_ = PendingPrefetch {
+        .index = index,
+        .loaded = std::async(std::launch::async,
+            [pack = pack, cache = cache, path = midi_slots_[index].path] {
+                return LoadMIDIBody(pack, cache, path);
+            })
+    };
+}
+
+auto Resources::GetResidentMemory() const -> size_t
+{
+    return resident_memory_;
+}
+
+// Repeated paths are counted within the current manifest, so reloading it
+// doesn't count them again. What they save is only known once loaded.
+auto Resources::GetInternStats() const -> InternStats
+{
+    InternStats stats {
+        .content_hits = content_hits_,
+        .bytes_saved = content_bytes_saved_
+    };
+
+    for (MIDIIndex index = 0; index < midi_slots_.size(); ++index) {
+        uint32_t references = midi_slots_[index].manifest_references;
+        if (references < 2) continue;
+
+        stats.path_hits += references - 1;
+        stats.bytes_saved += (references - 1) * midi_slots_[Resolve(index)].memory_usage;
+    }
+
+    return stats;
+}
+
+auto Resources::ApplyUpdate(ResourceUpdate update) -> tb::error<LoadExercisesError>
+{
+    for (auto& [path, loaded] : update.midis) {
+        if (auto slot = midi_paths_.find(path); slot != midi_paths_.end())
+            Reload(slot->second, std::move(loaded));
+    }
+
+    if (update.exercises)
+        return SetExercises(*update.exercises);
+
     return tb::ok;
 }
 
-Game::Game(const Resources& resources) : resources_(resources) {}
+auto Resources::Register(std::string normal_path) -> MIDIIndex
+{
+    if (auto interned = midi_paths_.find(normal_path); interned != midi_paths_.end())
+        return interned->second;
+
+    auto index = static_cast<MIDIIndex>(midi_slots_.size());
+    midi_slots_.push_back({ .path = normal_path });
+    midi_paths_.emplace(std::move(normal_path), index);
+    return index;
+}
+
+// Takes the background load when it is for this slot. Failures are reported
+// with the path here, as otherwise a prefetch would fail unseen.
+auto Resources::Load(MIDIIndex index) -> LoadedMIDI
+{
+    const std::string& path = midi_slots_[index].path;
+    LoadedMIDI loaded = prefetch_ && prefetch_->index == index
+                      ? prefetch_->loaded.get()
+                      : LoadMIDIBody(pack, cache, path);
+
+    if (prefetch_ && prefetch_->index == index)
+        prefetch_.reset();
+
+    if (loaded.midi.is_error())
+        tb::print("Couldn't load '{}': {}\n", path, loaded.midi.get_error().What());
+
+    return loaded;
+}
+
+// Slots found to hold the same contents as another load through that one
+auto Resources::Resolve(MIDIIndex index) const -> MIDIIndex
+{
+    MIDIIndex same_as = midi_slots_[index].same_as;
+    return same_as != INVALID_RESOURCE ? same_as : index;
+}
+
+auto Resources::Adopt(MIDIIndex index, LoadedMIDI loaded)
+    -> tb::result<SharedMIDI, midi::Error>
+{
+    if (loaded.midi.is_error())
+        return loaded.midi.get_error();
+
+    if (auto interned = midi_contents_.find(loaded.content_hash);
+        interned != midi_contents_.end() && interned->second != index) {
+        MIDIIndex same_as = interned->second;
+        ++content_hits_;
+        midi_slots_[index].same_as = same_as;
+
+        // What was just loaded stands in for the other slot rather than it
+        // being loaded a second time
+        if (!midi_slots_[same_as].midi)
+            return Adopt(same_as, std::move(loaded));
+
+        content_bytes_saved_ += loaded.midi.get_unchecked().MemoryUsage();
+        return GetMIDI(same_as);
+    }
+
+    midi_contents_.emplace(loaded.content_hash, index);
+
+    MIDISlot& slot = midi_slots_[index];
+    slot.midi = std::make_shared<const midi::MIDI>(
+        std::move(loaded.midi.get_mut_unchecked()));
+    slot.memory_usage = slot.midi->MemoryUsage();
+    slot.lru_position = lru_.insert(lru_.begin(), index);
+    resident_memory_ += slot.memory_usage;
+
+    EvictToBudget(index);
+    return slot.midi;
+}
+
+// Also forgets the slot's contents and whatever shared them, as its file could
+// change unnoticed before it is loaded again
+void Resources::Evict(MIDIIndex index)
+{
+    std::erase_if(midi_contents_, [index] (const auto& entry) {
+        return entry.second == index;
+    });
+    for (MIDISlot& slot : midi_slots_) {
+        if (slot.same_as == index)
+            slot.same_as = INVALID_RESOURCE;
+    }
+
+    MIDISlot& slot = midi_slots_[index];
+    if (!slot.midi) return;
+
+    resident_memory_ -= slot.memory_usage;
+    slot.midi.reset();
+    lru_.erase(slot.lru_position);
+}
+
+// Drops the least recently used MIDIs that can be reloaded until the rest fit.
+// MIDIs held elsewhere are skipped, as dropping them would free nothing.
+void Resources::EvictToBudget(MIDIIndex keep)
+{
+    for (auto it = lru_.end(); resident_memory_ > memory_budget && it != lru_.begin();) {
+        MIDIIndex index = *--it;
+        const MIDISlot& slot = midi_slots_[index];
+        if (index == keep || slot.midi.use_count() > 1 || slot.path.empty())
+            continue;
+
+        it = std::next(it);
+        Evict(index);
+    }
+}
+
+// Replaces a changed file's MIDI, which also ends any sharing with slots that
+// had the same contents before the change
+void Resources::Reload(MIDIIndex index, LoadedMIDI loaded)
+{
+    if (prefetch_ && Resolve(prefetch_->index) == Resolve(index))
+        prefetch_.reset();
+
+    bool resident = midi_slots_[Resolve(index)].midi != nullptr;
+    midi_slots_[index].same_as = INVALID_RESOURCE;
+    Evict(index);
+
+    // Others are left to load when they are next needed
+    if (resident && Adopt(index, std::move(loaded)).is_error())
+        tb::print("Couldn't reload '{}'\n", midi_slots_[index].path);
+}
+
+Game::Game(Resources& resources) : resources_(resources) {}
 
 void Game::SetCadences(MIDIIndex major, MIDIIndex minor)
 {
@@ -184,35 +506,58 @@ void Game::InputNote(uint8_t note)
     }
 }
 
-auto Game::BeginNewExercise() -> tb::error<NoExercisesError>
+auto Game::BeginNewExercise() -> tb::result<ExerciseMIDIs, BeginExerciseError>
 {
     static std::random_device rand_dev;
     static std::uniform_int_distribution<uint8_t> input_key(0, 11);
 
     if (resources_.exercises.empty())
-        return NoExercisesError {};
+        return BeginExerciseError { BeginExerciseError::NO_EXERCISES };
 
     std::uniform_int_distribution<ExerciseIndex>
         exercise_index(0, resources_.exercises.size() - 1);
 
+    // The exercises may have been reloaded since it was drawn
+    if (next_exercise_ >= resources_.exercises.size())
+        next_exercise_ = exercise_index(rand_dev);
+
+    const Exercise exercise = resources_.exercises[next_exercise_];
+
+    // Picked now so its MIDI can load while this exercise is played. Also picked
+    // when this one fails to load, so a bad MIDI isn't drawn every time.
+    next_exercise_ = exercise_index(rand_dev);
+    tb::scoped_guard prefetch_next = [this] {
+        resources_.Prefetch(resources_.exercises[next_exercise_].midi);
+    };
+
+    MIDIIndex cadence_index = CadenceFor(exercise.tonality);
+    if (cadence_index == INVALID_RESOURCE)
+        return BeginExerciseError { BeginExerciseError::MIDI_ERROR };
+
+    auto cadence = resources_.GetMIDI(cadence_index);
+    auto midi = resources_.GetMIDI(exercise.midi);
+    if (cadence.is_error() || midi.is_error())
+        return BeginExerciseError { BeginExerciseError::MIDI_ERROR };
+
     note_input_buffer_.clear();
     exercise_notes_.clear();
     state_ = GameState::PLAYING_CADENCE;
 
-    current_exercise_ = exercise_index(rand_dev);
-    const Exercise* exercise_ptr = GetCurrentExercise();
+    current_exercise_ = exercise;
     required_input_key_ = static_cast<midi::PitchClass>(input_key(rand_dev));
 
-    if (exercise_ptr->type == ExerciseType::SINGLE_VOICE_TRANSCRIPTION) {
-        resources_.midis[exercise_ptr->midi].tracks[0].ToNoteSeries(exercise_notes_);
-    }
+    if (exercise.type == ExerciseType::SINGLE_VOICE_TRANSCRIPTION)
+        midi.get_unchecked()->tracks[0].ToNoteSeries(exercise_notes_);
 
-    return tb::ok;
+    return ExerciseMIDIs {
+        .cadence = std::move(cadence.get_mut_unchecked()),
+        .exercise = std::move(midi.get_mut_unchecked())
+    };
 }
 
 auto Game::GetCurrentExercise() const -> const Exercise*
 {
-    return &(resources_.exercises[current_exercise_]);
+    return current_exercise_ ? &*current_exercise_ : nullptr;
 }
 
 auto Game::GetRequiredInputKey() const -> midi::PitchClass
@@ -220,17 +565,22 @@ auto Game::GetRequiredInputKey() const -> midi::PitchClass
     return required_input_key_;
 }
 
-auto Game::GetCurrentCadenceMIDI() const -> const midi::MIDI*
+auto Game::GetCurrentCadence() const -> MIDIIndex
 {
-    if (current_exercise_ == INVALID_RESOURCE)
-        return nullptr;
+    if (!current_exercise_)
+        return INVALID_RESOURCE;
+
+    return CadenceFor(current_exercise_->tonality);
+}
 
-    switch (GetCurrentExercise()->tonality) {
+auto Game::CadenceFor(Tonality tonality) const -> MIDIIndex
+{
+    switch (tonality) {
     default:
     case Tonality::MAJOR:
-        return &resources_.midis[major_cadence];
+        return major_cadence;
     case Tonality::MINOR:
-        return &resources_.midis[minor_cadence];
+        return minor_cadence;
     }
 }
 
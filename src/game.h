@@ -1,8 +1,17 @@
 #pragma once
 
+#include <future>
+#include <list>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "cache.h"
 #include "midi.h"
+#include "pack.h"
 
 #include <tb/tb.h>
 
@@ -77,37 +86,172 @@ struct Exercise
     Difficulty difficulty;
 };
 
-struct Resources
+// Exercises given a MIDI already used by another, and the memory that loading
+// copies would have taken
+struct InternStats
 {
-    std::vector<midi::MIDI> midis;
+    size_t path_hits = 0, content_hits = 0;
+    size_t bytes_saved = 0;
+};
+
+// A line of the exercise manifest, before its MIDI is registered
+struct ExerciseEntry
+{
+    std::string path;
+    ExerciseType type;
+    Tonality tonality;
+    Difficulty difficulty;
+};
+
+auto ParseExerciseManifest(std::string_view path)
+    -> tb::result<std::vector<ExerciseEntry>, LoadExercisesError>;
+auto ParseExerciseManifest(std::span<const uint8_t> contents)
+    -> tb::result<std::vector<ExerciseEntry>, LoadExercisesError>;
+
+struct LoadedMIDI
+{
+    tb::result<midi::MIDI, midi::Error> midi;
+    uint64_t content_hash = 0;
+};
+
+// Safe on any thread, as the cache and packs are
+auto LoadMIDIBody(MIDICache* cache, const std::string& path) -> LoadedMIDI;
+// From the pack when it holds the path, otherwise from the file
+auto LoadMIDIBody(const pack::ResourcePack* pack, MIDICache* cache,
+    const std::string& path) -> LoadedMIDI;
+// Stats and reads the files in batches, in the order given
+auto LoadMIDIBodies(MIDICache* cache, std::span<const std::string> paths)
+    -> std::vector<LoadedMIDI>;
+
+// Files re-read after changing on disk, applied by the main thread in one step
+struct ResourceUpdate
+{
+    std::optional<std::vector<ExerciseEntry>> exercises;
+    std::vector<std::pair<std::string, LoadedMIDI>> midis;
+};
+
+// Enough for a large library's working set, while the rest stays on disk
+constexpr size_t DEFAULT_MIDI_MEMORY_BUDGET = 64 << 20;
+
+using SharedMIDI = std::shared_ptr<const midi::MIDI>;
+
+// A MIDI known by path, parsed when first needed and dropped again when the
+// memory budget runs out or the file changes. A slot keeps its index for good,
+// whether or not its MIDI is resident.
+struct MIDISlot
+{
+    std::string path;       // Empty for MIDIs added from memory
+    SharedMIDI midi;        // Null until loaded, and once evicted
+    size_t memory_usage = 0;
+    MIDIIndex same_as = INVALID_RESOURCE;   // A slot with identical contents
+    uint32_t manifest_references = 0;   // Exercises in the manifest that use it
+    std::list<MIDIIndex>::iterator lru_position;    // While resident
+};
+
+class Resources
+{
+public:
     std::vector<Exercise> exercises;
+    MIDICache* cache = nullptr;     // Optional, parses every file without one
+    // Optional. The manifest and any MIDIs it holds are read from it rather
+    // than from files.
+    const pack::ResourcePack* pack = nullptr;
+    size_t memory_budget = DEFAULT_MIDI_MEMORY_BUDGET;  // Bytes of resident MIDIs
 
+    // Registers a MIDI file without reading it, checking only that it exists
     auto LoadMIDI(std::string_view path) -> tb::result<MIDIIndex, midi::Error>;
+    // Never evicted, as there is nothing to reload it from
+    auto AddMIDI(midi::MIDI midi) -> MIDIIndex;
     auto LoadExercises(std::string_view path) -> tb::error<LoadExercisesError>;
+    auto SetExercises(std::span<const ExerciseEntry> entries)
+        -> tb::error<LoadExercisesError>;
+    auto GetMIDIPaths() const -> std::vector<std::string>;
+
+    // Loads the MIDI if it isn't resident. Whoever holds the pointer keeps that
+    // version alive through evictions and reloads, so playback holds on to the
+    // MIDIs it refers to.
+    auto GetMIDI(MIDIIndex index) -> tb::result<SharedMIDI, midi::Error>;
+    // Starts loading on a background thread, for a GetMIDI expected soon
+    void Prefetch(MIDIIndex index);
+    auto GetResidentMemory() const -> size_t;
+    auto GetInternStats() const -> InternStats;
+
+    // Swaps in changed files. Exercises already begun keep what they hold.
+    auto ApplyUpdate(ResourceUpdate update) -> tb::error<LoadExercisesError>;
+
+private:
+    struct PendingPrefetch
+    {
+        MIDIIndex index;
+        std::future<LoadedMIDI> loaded;
+    };
+
+    auto Register(std::string normal_path) -> MIDIIndex;
+    auto Load(MIDIIndex index) -> LoadedMIDI;
+    auto Resolve(MIDIIndex index) const -> MIDIIndex;
+    auto Adopt(MIDIIndex index, LoadedMIDI loaded) -> tb::result<SharedMIDI, midi::Error>;
+    void Evict(MIDIIndex index);
+    void EvictToBudget(MIDIIndex keep);
+    void Reload(MIDIIndex index, LoadedMIDI loaded);
+
+    std::vector<MIDISlot> midi_slots_;
+    std::list<MIDIIndex> lru_;      // Resident slots, most recently used first
+    size_t resident_memory_ = 0;
+    std::optional<PendingPrefetch> prefetch_;
+    size_t content_hits_ = 0, content_bytes_saved_ = 0;
+
+    // The same file, or a file with the same contents, is only loaded once
+    std::unordered_map<std::string, MIDIIndex> midi_paths_;
+    std::unordered_map<uint64_t, MIDIIndex> midi_contents_;
+};
+
+struct BeginExerciseError
+{
+    enum Type { NO_EXERCISES, MIDI_ERROR } type;
+
+    constexpr auto What() const -> std::string_view
+    {
+        switch (type) {
+        case NO_EXERCISES:
+            return "no exercises";
+        case MIDI_ERROR:
+            return "error loading midi";
+        }
+    }
 };
 
-struct NoExercisesError {};
+// Held by whoever plays an exercise, loaded before it begins
+struct ExerciseMIDIs
+{
+    SharedMIDI cadence;
+    SharedMIDI exercise;
+};
 
 class Game
 {
 public:
-    Game(const Resources& resources);
+    Game(Resources& resources);
 
     void SetCadences(MIDIIndex major, MIDIIndex minor);
     void InputNote(uint8_t note);
-    auto BeginNewExercise() -> tb::error<NoExercisesError>;
+    // Nothing changes unless both MIDIs load, so a failed exercise can be
+    // followed by another
+    auto BeginNewExercise() -> tb::result<ExerciseMIDIs, BeginExerciseError>;
     auto GetCurrentExercise() const -> const Exercise*;
     auto GetRequiredInputKey() const -> midi::PitchClass;
-    auto GetCurrentCadenceMIDI() const -> const midi::MIDI*;
+    auto GetCurrentCadence() const -> MIDIIndex;
     void MIDIEnded();
     auto GetState() const -> GameState;
 
 private:
+    auto CadenceFor(Tonality tonality) const -> MIDIIndex;
+
     MIDIIndex major_cadence = INVALID_RESOURCE, minor_cadence = INVALID_RESOURCE;
     std::vector<uint8_t> note_input_buffer_ = tb::with_capacity(32);
     std::vector<uint8_t> exercise_notes_ = tb::with_capacity(32);
-    const Resources& resources_;
-    ExerciseIndex current_exercise_ = INVALID_RESOURCE;
+    Resources& resources_;
+    std::optional<Exercise> current_exercise_;  // A copy, as exercises can reload
+    ExerciseIndex next_exercise_ = INVALID_RESOURCE;   // Drawn early to be prefetched
     GameState state_ = GameState::WAIT_FOR_READY;
     midi::PitchClass required_input_key_ = midi::PitchClass::C;
     int8_t octave_displacement_ = 0;
@@ -9,9 +9,12 @@
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_main.h>
 
+#include <cstdlib>
+#include <cstring>
 #include <random>
 
-constexpr int SAMPLE_RATE = 64000;
+// Oscillators are band-limited, so nothing above the audible range needs room
+constexpr int SAMPLE_RATE = 48000;
 
 auto SDL_AppInit_Safe(void** appstate, int argc, char** argv) -> SDL_AppResult
 {
@@ -53,6 +56,19 @@ auto SDL_AppInit_Safe(void** appstate, int argc, char** argv) -> SDL_AppResult
     *appstate = ctx;
     SoundContext& sound_ctx = ctx->sound_ctx;
 
+    sound_ctx.live_playback.generator.strings.Allocate(spec.freq);
+    sound_ctx.file_playback.generator.strings.Allocate(spec.freq);
+    sound_ctx.file_playback.metronome.Allocate(spec.freq);
+
+    // Opt-in, as locked memory and real-time priority need extra privileges
+    if (const char* realtime = std::getenv("WTE_REALTIME"); realtime && *realtime != '0') {
+        sound_ctx.realtime = true;
+        if (auto result = LockAudioMemory(sound_ctx); result.is_error()) {
+            tb::print("Real-time mode: {}: {}\n", result.get_error().What(),
+                strerror(result.get_error().errno_value));
+        }
+    }
+
     sound_ctx.live_playback.stream.reset(
         SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK,
             &spec, Audio_LiveCallback, &sound_ctx)
@@ -67,6 +83,14 @@ auto SDL_AppInit_Safe(void** appstate, int argc, char** argv) -> SDL_AppResult
         return SDL_APP_FAILURE;
     }
 
+    if (argc >= 3) {
+        if (auto result = ctx->LoadSoundFont(argv[2]); result.is_error()) {
+            tb::print("Failed to load soundfont '{}': {}\n", argv[2],
+                result.get_error().What());
+            return SDL_APP_FAILURE;
+        }
+    }
+
     if (auto result = ctx->SetupMIDIControllerConnection(); result.is_error()) {
         tb::print("Couldn't find device for live MIDI playback\n");
     }
@@ -78,9 +102,50 @@ auto SDL_AppInit_Safe(void** appstate, int argc, char** argv) -> SDL_AppResult
     constexpr std::string_view major_cadence = "midis/cadences/major.mid";
     constexpr std::string_view minor_cadence = "midis/cadences/minor.mid";
 
+    // Set WTE_CACHE_DIR to an empty string to always parse
+    if (std::string directory = DefaultCacheDirectory(); !directory.empty()) {
+        ctx->midi_cache.emplace(std::move(directory));
+        ctx->resources.cache = &*ctx->midi_cache;
+    }
+
+    // A pack stands in for the manifest, and holds the MIDIs it uses
+    if (pack::ResourcePack::IsPack(exercises_file_path)) {
+        auto pack = pack::ResourcePack::FromFile(exercises_file_path);
+        if (pack.is_error()) {
+            tb::print("Failed to open pack '{}': {}\n", exercises_file_path,
+                pack.get_error().What());
+            return SDL_APP_FAILURE;
+        }
+        ctx->resource_pack = std::move(pack.get_mut_unchecked());
+        ctx->resources.pack = &*ctx->resource_pack;
+    }
+
+    if (const char* budget = std::getenv("WTE_MIDI_MEMORY_MB"))
+        ctx->resources.memory_budget = strtoull(budget, nullptr, 10) << 20;
+
+    if (const char* accompaniment = std::getenv("WTE_ACCOMPANIMENT"))
+        ctx->accompaniment_path = accompaniment;
+
     if (ctx->LoadResources(exercises_file_path, major_cadence, minor_cadence).is_error())
         return SDL_APP_FAILURE;
 
+    if (ctx->midi_cache)
+        ctx->midi_cache->BeginWriting();
+
+    // Without it, edits to exercises only show after a restart. Packs are
+    // installed whole, so aren't watched.
+    if (!ctx->resource_pack) {
+        ResourceWatcher& watcher = ctx->watcher.emplace(std::string(exercises_file_path),
+            ctx->resources.cache);
+        if (auto result = watcher.Start(); result.is_error()) {
+            tb::print("Not reloading changed files: {}: {}\n", result.get_error().What(),
+                strerror(result.get_error().errno_value));
+            ctx->watcher.reset();
+        } else {
+            watcher.WatchFiles(ctx->resources.GetMIDIPaths());
+        }
+    }
+
     SDL_ResumeAudioStreamDevice(sound_ctx.file_playback.stream.get());
 
     SDL_SetEventEnabled(SDL_EVENT_MOUSE_MOTION, false);
@@ -88,7 +153,10 @@ auto SDL_AppInit_Safe(void** appstate, int argc, char** argv) -> SDL_AppResult
     for (uint32_t event_type = 0x200; event_type < 0x300; ++event_type)
         SDL_SetEventEnabled(event_type, false);
 
-    tb::print("Press Q to quit\n");
+    tb::print("Press Q to quit, I to change instrument, Left to rewind, "
+              "L to loop, M for metronome, Up and Down to change speed\n");
+    if (!ctx->accompaniment_path.empty())
+        tb::print("Press A to play along with '{}'\n", ctx->accompaniment_path);
 
     return SDL_APP_CONTINUE;
 }
@@ -107,6 +175,18 @@ void SDL_AppQuit(void* appstate, SDL_AppResult result)
 {
     auto* ctx = static_cast<AppContext*>(appstate);
 
+    if (ctx) {
+        ctx->sound_ctx.live_playback.callback_stats.Report("Live");
+        ctx->sound_ctx.file_playback.callback_stats.Report("File");
+
+        // MIDIs load lazily, so identical contents are only found as they're used
+        InternStats interned = ctx->resources.GetInternStats();
+        if (interned.path_hits + interned.content_hits > 0) {
+            tb::print("Shared {} repeated and {} identical MIDIs, saving {} KiB\n",
+                interned.path_hits, interned.content_hits, interned.bytes_saved / 1024);
+        }
+    }
+
     delete ctx;
     usb::Exit();
 }
@@ -149,6 +229,27 @@ auto SDL_AppEvent_Safe(void* appstate, SDL_Event* event) -> SDL_AppResult
         case SDLK_R:
             ctx->BeginExercise();
             break;
+        case SDLK_A:
+            ctx->PlayAccompaniment();
+            break;
+        case SDLK_I:
+            ctx->SelectSynth(ctx->current_synth + 1);
+            break;
+        case SDLK_LEFT:
+            ctx->Rewind(2.0);
+            break;
+        case SDLK_L:
+            ctx->ToggleLoop();
+            break;
+        case SDLK_M:
+            ctx->ToggleMetronome();
+            break;
+        case SDLK_UP:
+            ctx->ChangePlaybackRate(0.1f);
+            break;
+        case SDLK_DOWN:
+            ctx->ChangePlaybackRate(-0.1f);
+            break;
         default:
             break;
         }
@@ -158,8 +259,10 @@ auto SDL_AppEvent_Safe(void* appstate, SDL_Event* event) -> SDL_AppResult
         break;
     }
 
-    if (event->type == MIDIPlayerEndEvent::EVENT_NUMBER) {
-        ctx->MIDIEnded();
+    if (event->type == TransportEvent::EVENT_NUMBER) {
+        ctx->CueChanged(*reinterpret_cast<TransportEvent*>(event));
+    } else if (event->type == ResourcesChangedEvent::EVENT_NUMBER) {
+        ctx->ReloadResources();
     } else if (event->type == MIDIInputEvent::EVENT_NUMBER) {
         auto* ev = reinterpret_cast<MIDIInputEvent*>(event);
 
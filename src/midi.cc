@@ -1,6 +1,8 @@
 #include "midi.h"
+#include "midistream.h"
 
 #include <limits>
+#include <utility>
 
 struct VariableLengthInt
 {
@@ -62,16 +64,41 @@ auto MIDI::FromFile(std::string_view path) -> tb::result<MIDI, Error>
     return FromStream(file);
 }
 
-auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Error>
+auto MIDI::FromMemory(std::span<const uint8_t> bytes) -> tb::result<MIDI, Error>
 {
-    Stream stream(file);
+    FILE* file = fmemopen(const_cast<uint8_t*>(bytes.data()), bytes.size(), "rb");
+    if (!file)
+        return Error { Error::NO_HEADER_FOUND };
+
+    tb::scoped_guard close_file = [file] { fclose(file); };
+    return FromStream(file);
+}
 
-    EventType running_type;
+auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Error>
+{
+    TrackDecoder decoder(Stream(file).Position().get_unchecked(), track_size);
     Track track;
 
-    size_t start = stream.Position().get_unchecked();
+    if (auto result = decoder.Read(file, track.events); result.is_error())
+        return result.get_error();
+
+    if (!track.events.empty() && track.events.back().meta_type != MetaType::END_TRACK)
+        return Error { Error::MISSING_EVENT, decoder.Position() };
+
+    return track;
+}
+
+TrackDecoder::TrackDecoder(size_t start, uint32_t track_size)
+: position_(start), end_(start + track_size) {}
 
-    while (stream.Position().get_unchecked() < start + track_size) {
+// Stops early once max_events have been appended
+auto TrackDecoder::Read(FILE* file, std::vector<Event>& events, size_t max_events)
+    -> tb::error<Error>
+{
+    Stream stream(file);
+    const size_t first_event = events.size();
+
+    while (position_ < end_ && events.size() - first_event < max_events) {
         auto event_info = stream.Read(tb::type_tag<VariableLengthInt, EventType>);
         if (event_info.is_error())
             return Error {
@@ -80,6 +107,10 @@ auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Err
             };
 
         auto [delta, type] = event_info.get_unchecked();
+        size_t event_count = events.size();
+
+        // Events that aren't kept pass their delta time on to the next one
+        delta.value += skipped_ticks_;
         auto bad_event_error = [&stream] {
             return Error {
                 Error::BAD_EVENT,
@@ -101,7 +132,7 @@ auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Err
                 if (usec_per_quarter.is_error())
                     return bad_event_error();
 
-                track.events.push_back(Event {
+                events.push_back({
                     .delta_time = delta.value,
                     .type = EventType::META,
                     .meta_type = MetaType::TEMPO,
@@ -109,8 +140,31 @@ auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Err
                 });
                 break;
             }
+            case MetaType::TIME_SIGNATURE: {
+                auto fields = stream.Read(
+                    tb::type_tag<uint8_t, uint8_t, uint8_t, uint8_t>);
+                if (length.value < 4 || fields.is_error())
+                    return bad_event_error();
+
+                auto [numerator, denominator_power, clocks, thirty_seconds]
+                    = fields.get_unchecked();
+                stream.Skip(length.value - 4).ignore_error();
+
+                events.push_back({
+                    .delta_time = delta.value,
+                    .type = EventType::META,
+                    .meta_type = MetaType::TIME_SIGNATURE,
+                    .time_signature = {
+                        .numerator = numerator,
+                        .denominator_power = denominator_power,
+                        .clocks_per_click = clocks,
+                        .thirty_seconds_per_quarter = thirty_seconds
+                    }
+                });
+                break;
+            }
             case MetaType::END_TRACK: {
-                track.events.push_back({
+                events.push_back({
                     .delta_time = delta.value,
                     .type = EventType::META,
                     .meta_type = MetaType::END_TRACK
@@ -124,10 +178,10 @@ auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Err
         } else {
             auto type_byte = static_cast<uint8_t>(type) & 0xF0;
             if (type_byte < 0x80) {
-                type_byte = static_cast<uint8_t>(running_type) & 0xF0;
+                type_byte = static_cast<uint8_t>(running_type_) & 0xF0;
                 stream.Skip(-1).ignore_error();
-            } else {
-                running_type = type;
+            } else if (type_byte != static_cast<uint8_t>(EventType::SYSEX)) {
+                running_type_ = type;
             }
 
             auto e_type = static_cast<EventType>(type_byte);
@@ -137,7 +191,7 @@ auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Err
             case EventType::NOTE_ON: {
                 auto [note, vel]
                     = stream.Read(tb::type_tag<uint8_t, uint8_t>).get_unchecked();
-                track.events.push_back({
+                events.push_back({
                     .delta_time = delta.value,
                     .type = vel == 0 ? EventType::NOTE_OFF : e_type,
                     .note_event = {
@@ -156,18 +210,34 @@ auto Track::FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Err
             case EventType::CHANNEL_PRESSURE:
                 stream.Skip(1).ignore_error();
                 break;
-            case EventType::SYSEX:
+            case EventType::SYSEX: {
+                // Both F0 messages and F7 escapes carry a length before their data
+                auto length = stream.Read<VariableLengthInt>();
+                if (length.is_error())
+                    return bad_event_error();
+                stream.Skip(length.get_unchecked().value).ignore_error();
                 break;
+            }
             default:
                 return bad_event_error();
             }
         }
+
+        skipped_ticks_ = events.size() == event_count ? delta.value : 0;
+        position_ = stream.Position().get_unchecked();
     }
 
-    if (!track.events.empty() && track.events.back().meta_type != MetaType::END_TRACK)
-        return Error { Error::MISSING_EVENT, stream.Position().get_unchecked() };
+    return tb::ok;
+}
 
-    return track;
+auto TrackDecoder::Position() const -> size_t
+{
+    return position_;
+}
+
+auto TrackDecoder::Finished() const -> bool
+{
+    return position_ >= end_;
 }
 
 void Track::ToNoteSeries(std::vector<uint8_t>& output) const
@@ -181,7 +251,79 @@ void Track::ToNoteSeries(std::vector<uint8_t>& output) const
     );
 }
 
-auto MIDI::FromStream(FILE* file) -> tb::result<MIDI, Error>
+// Plays the whole MIDI once, saving the player's state at regular intervals
+auto BuildCheckpoints(const MIDI& midi) -> std::vector<Checkpoint>
+{
+    Player player;
+    player.SetMIDI(midi);
+
+    std::vector<Checkpoint> checkpoints { player.SaveCheckpoint() };
+
+    for (size_t steps = 1; !player.Advance().is_error(); ++steps) {
+        if (steps % CHECKPOINT_INTERVAL == 0)
+            checkpoints.push_back(player.SaveCheckpoint());
+    }
+
+    return checkpoints;
+}
+
+// Lays a click on every beat of each time signature, restarting the bar at
+// each change
+auto BuildBeats(const MIDI& midi) -> std::vector<Beat>
+{
+    std::vector<std::pair<Ticks, TimeSignature>> signatures;
+    for (const Track& track : midi.tracks) {
+        Ticks tick = 0;
+        for (const Event& event : track.events) {
+            tick += event.delta_time;
+            if (event.type == EventType::META
+                && event.meta_type == MetaType::TIME_SIGNATURE)
+                signatures.emplace_back(tick, event.time_signature);
+        }
+    }
+
+    std::ranges::stable_sort(signatures, {}, &std::pair<Ticks, TimeSignature>::first);
+
+    std::vector<Beat> beats;
+    TimeSignature signature = DEFAULT_TIME_SIGNATURE;
+    Ticks bar_start = 0;
+    auto next_signature = signatures.begin();
+
+    for (Ticks tick = 0; tick < midi.length;) {
+        Ticks next_change = std::numeric_limits<Ticks>::max();
+
+        for (; next_signature != signatures.end(); ++next_signature) {
+            if (next_signature->first > tick) {
+                next_change = next_signature->first;
+                break;
+            }
+            signature = next_signature->second;
+            bar_start = tick;
+        }
+
+        Ticks quarter = midi.ticks_per_quarter_note;
+        Ticks unit = (quarter * 4) >> std::min<uint8_t>(signature.denominator_power, 6);
+        Ticks beat = signature.clocks_per_click > 0
+                   ? quarter * signature.clocks_per_click / 24
+                   : unit;
+        Ticks bar = std::max<Ticks>(unit * signature.numerator, 1);
+
+        beats.push_back({ .tick = tick, .downbeat = (tick - bar_start) % bar == 0 });
+        tick = std::min(tick + std::max<Ticks>(beat, 1), next_change);
+    }
+
+    return beats;
+}
+
+// Fields in a MIDI file are big-endian
+constexpr auto to_native_endian = [] (std::integral auto x) {
+    if constexpr (std::endian::native == std::endian::little)
+        return tb::reverse_endian(x);
+    else
+        return x;
+};
+
+auto Header::FromStream(FILE* file) -> tb::result<Header, Error>
 {
     Stream stream(file);
 
@@ -189,13 +331,6 @@ auto MIDI::FromStream(FILE* file) -> tb::result<MIDI, Error>
         || memcmp(chunk_type, "MThd", 4) != 0)
         return Error { Error::NO_HEADER_FOUND, 0 };
 
-    constexpr auto to_native_endian = [] (std::integral auto x) {
-        if constexpr (std::endian::native == std::endian::little)
-            return tb::reverse_endian(x);
-        else
-            return x;
-    };
-
     auto header = stream.Read(
         tb::type_tag<uint32_t, uint16_t, uint16_t, uint16_t>,
         to_native_endian
@@ -216,26 +351,56 @@ auto MIDI::FromStream(FILE* file) -> tb::result<MIDI, Error>
         };
 
     // TODO: Handle tickdiv type = 1
-    MIDI midi {
-        .tracks = tb::with_capacity(track_count),
+    if ((tick_div & 0x7FFF) == 0)
+        return Error {
+            Error::INVALID_FORMAT,
+            stream.Position().get_unchecked()
+        };
+
+    return Header {
         .format = static_cast<Format>(format),
+        .track_count = track_count,
         .ticks_per_quarter_note = static_cast<uint16_t>(tick_div & 0x7FFF)
     };
+}
 
-    for (size_t i = 0; i < track_count; ++i) {
-        if (char chunk_type[4]; stream.ReadToArray(chunk_type, 4).is_error()
-            || memcmp(chunk_type, "MTrk", 4) != 0)
-            return Error {
-                Error::MISSING_TRACK,
-                stream.Position().get_unchecked()
-            };
+auto Track::ChunkSize(FILE* file) -> tb::result<uint32_t, Error>
+{
+    Stream stream(file);
+
+    if (char chunk_type[4]; stream.ReadToArray(chunk_type, 4).is_error()
+        || memcmp(chunk_type, "MTrk", 4) != 0)
+        return Error {
+            Error::MISSING_TRACK,
+            stream.Position().get_unchecked()
+        };
+
+    auto track_size = stream.Read<uint32_t>(to_native_endian);
+    if (track_size.is_error())
+        return Error {
+            Error::MISSING_TRACK,
+            stream.Position().get_unchecked()
+        };
+
+    return track_size.get_unchecked();
+}
+
+auto MIDI::FromStream(FILE* file) -> tb::result<MIDI, Error>
+{
+    auto header = Header::FromStream(file);
+    if (header.is_error())
+        return header.get_error();
 
-        auto track_size = stream.Read<uint32_t>(to_native_endian);
+    MIDI midi {
+        .tracks = tb::with_capacity(header.get_unchecked().track_count),
+        .format = header.get_unchecked().format,
+        .ticks_per_quarter_note = header.get_unchecked().ticks_per_quarter_note
+    };
+
+    for (size_t i = 0; i < header.get_unchecked().track_count; ++i) {
+        auto track_size = Track::ChunkSize(file);
         if (track_size.is_error())
-            return Error {
-                Error::MISSING_TRACK,
-                stream.Position().get_unchecked()
-            };
+            return track_size.get_error();
 
         auto track = Track::FromStream(file, track_size.get_unchecked());
         if (track.is_error())
@@ -244,19 +409,192 @@ auto MIDI::FromStream(FILE* file) -> tb::result<MIDI, Error>
         midi.tracks.emplace_back(track.get_mut_unchecked());
     }
 
+    midi.tempo_map = TempoMap(midi.tracks, midi.ticks_per_quarter_note);
+    midi.checkpoints = BuildCheckpoints(midi);
+
+    for (const Track& track : midi.tracks) {
+        Ticks track_length = 0;
+        for (const Event& event : track.events)
+            track_length += event.delta_time;
+        midi.length = std::max(midi.length, track_length);
+    }
+
+    midi.beats = BuildBeats(midi);
+
     return midi;
 }
 
+auto MIDI::Duration() const -> double
+{
+    return tempo_map.TicksToSeconds(length);
+}
+
+auto MIDI::MemoryUsage() const -> size_t
+{
+    size_t bytes = sizeof(MIDI) + tracks.capacity() * sizeof(Track)
+                 + tempo_map.GetChanges().size() * sizeof(TempoChange)
+                 + beats.capacity() * sizeof(Beat)
+                 + checkpoints.capacity() * sizeof(Checkpoint);
+
+    for (const Track& track : tracks)
+        bytes += track.events.capacity() * sizeof(Event);
+
+    for (const Checkpoint& checkpoint : checkpoints) {
+        bytes += checkpoint.tracks.capacity() * sizeof(TrackInfo)
+               + checkpoint.sounding_notes.capacity()
+                 * sizeof(decltype(checkpoint.sounding_notes)::value_type);
+    }
+
+    return bytes;
+}
+
+TempoMap::TempoMap(std::span<const Track> tracks, uint16_t ticks_per_quarter_note)
+: ticks_per_quarter_note_(ticks_per_quarter_note)
+{
+    std::vector<std::pair<Ticks, uint32_t>> tempos;
+    for (const Track& track : tracks) {
+        Ticks tick = 0;
+        for (const Event& event : track.events) {
+            tick += event.delta_time;
+            if (event.type == EventType::META && event.meta_type == MetaType::TEMPO
+                && event.usec_per_quarter_note != 0)
+                tempos.emplace_back(tick, event.usec_per_quarter_note);
+        }
+    }
+
+    // Stable, as Player applies simultaneous changes in track order
+    std::ranges::stable_sort(tempos, {}, &std::pair<Ticks, uint32_t>::first);
+
+    for (auto [tick, usec_per_quarter_note] : tempos) {
+        TempoChange& last = changes_.back();
+        if (tick == last.tick) {
+            last.usec_per_quarter_note = usec_per_quarter_note;
+            continue;
+        }
+
+        changes_.push_back({
+            .tick = tick,
+            .scaled_usec = last.scaled_usec + (tick - last.tick) * last.usec_per_quarter_note,
+            .usec_per_quarter_note = usec_per_quarter_note
+        });
+    }
+}
+
+// Changes as previously returned by GetChanges
+TempoMap::TempoMap(std::vector<TempoChange> changes, uint16_t ticks_per_quarter_note)
+: changes_(std::move(changes)), ticks_per_quarter_note_(ticks_per_quarter_note) {}
+
+auto TempoMap::TempoAt(Ticks tick) const -> const TempoChange&
+{
+    auto next = std::ranges::upper_bound(changes_, tick, {}, &TempoChange::tick);
+    return *(next - 1);
+}
+
+auto TempoMap::ScaledUsecAt(Ticks tick) const -> uint64_t
+{
+    const TempoChange& change = TempoAt(tick);
+    return change.scaled_usec + (tick - change.tick) * change.usec_per_quarter_note;
+}
+
+auto TempoMap::TicksAtScaledUsec(uint64_t scaled_usec) const -> Ticks
+{
+    auto next = std::ranges::upper_bound(changes_, scaled_usec, {},
+        &TempoChange::scaled_usec);
+    const TempoChange& change = *(next - 1);
+    return change.tick
+         + (scaled_usec - change.scaled_usec) / change.usec_per_quarter_note;
+}
+
+auto TempoMap::TicksToSeconds(Ticks tick) const -> double
+{
+    return ScaledUsecAt(tick) / (ticks_per_quarter_note_ * 1e6);
+}
+
+auto TempoMap::SecondsToTicks(double seconds) const -> Ticks
+{
+    return TicksAtScaledUsec(seconds * ticks_per_quarter_note_ * 1e6);
+}
+
+auto TempoMap::TicksToSamples(Ticks tick, uint32_t sample_rate) const -> uint64_t
+{
+    // Products can exceed 64 bits in long files at high sample rates
+    return static_cast<unsigned __int128>(ScaledUsecAt(tick)) * sample_rate
+         / (ticks_per_quarter_note_ * 1000000ull);
+}
+
+auto TempoMap::SamplesToTicks(uint64_t samples, uint32_t sample_rate) const -> Ticks
+{
+    return TicksAtScaledUsec(static_cast<unsigned __int128>(samples)
+        * ticks_per_quarter_note_ * 1000000ull / sample_rate);
+}
+
+auto TempoMap::GetChanges() const -> std::span<const TempoChange>
+{
+    return changes_;
+}
+
 Player::Player(PlayerMode mode) : mode_(mode) {}
 
+// A note off for a note that isn't sounding leaves nothing to release
+void Release(NoteInfo& info, double seconds)
+{
+    if (!info.note_on) return;
+    info.note_on = false;
+    info.released = true;
+    info.seconds_off = seconds;
+}
+
+// Defined ahead of Advance so that it inlines into the per-event loops
+inline void Player::ApplyEvent(const Event& event, TrackInfo& info)
+{
+    switch (event.type) {
+    case EventType::NOTE_ON:
+        if (event.note_event.note > MAX_NOTE) break;
+        notes_[event.note_event.note] = {
+            .time = ticks_elapsed_,
+            .seconds = seconds_elapsed_,
+            .velocity = event.note_event.velocity,
+            .note_on = true
+        };
+        break;
+    case EventType::NOTE_OFF:
+        if (event.note_event.note > MAX_NOTE) break;
+        Release(notes_[event.note_event.note], seconds_elapsed_);
+        break;
+    case EventType::META:
+        switch (event.meta_type) {
+        case MetaType::END_TRACK:
+            info.done = true;
+            break;
+        case MetaType::TEMPO:
+            ticks_per_second_ = midi_ptr_->ticks_per_quarter_note * 1000000.f
+                              / event.usec_per_quarter_note;
+            break;
+        default:
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 auto Player::Advance() -> tb::error<EndOfMIDIError>
 {
+    if (stream_) return AdvanceStream();
+
     std::optional<Ticks> ticks_or_none = TicksUntilNextEvent();
     if (!ticks_or_none) return EndOfMIDIError {};
 
     Ticks ticks = tb::copy_unchecked(ticks_or_none);
 
+    if (LoopPending() && ticks_elapsed_ + ticks == loop_->end) {
+        WrapLoop();
+        return tb::ok;
+    }
+
     ticks_elapsed_ += ticks;
+    seconds_elapsed_ += ticks / GetTicksPerSecond();
 
     for (auto& [track, info] : tracks_) {
         if (info.done) continue;
@@ -273,35 +611,48 @@ auto Player::Advance() -> tb::error<EndOfMIDIError>
         if (info.current_event_index >= track->events.size() - 1)
             info.done = true;
 
-        switch (next_ev.type) {
-        case EventType::NOTE_ON:
-            if (next_ev.note_event.note > MAX_NOTE) break;
-            notes_[next_ev.note_event.note] = {
-                .time = ticks_elapsed_,
-                .velocity = next_ev.note_event.velocity,
-                .note_on = true
+        ApplyEvent(next_ev, info);
+    }
+
+    return tb::ok;
+}
+
+// Advance for a stream, kept apart so the loop over whole tracks stays tight.
+// Streams can't loop, so there's no wrap to check for.
+auto Player::AdvanceStream() -> tb::error<EndOfMIDIError>
+{
+    std::optional<Ticks> ticks_or_none = TicksUntilNextStreamEvent();
+    if (!ticks_or_none) return EndOfMIDIError {};
+
+    Ticks ticks = tb::copy_unchecked(ticks_or_none);
+    ticks_elapsed_ += ticks;
+    seconds_elapsed_ += ticks / GetTicksPerSecond();
+
+    for (size_t i = 0; i < tracks_.size(); ++i) {
+        TrackInfo& info = tracks_[i].second;
+        const Event* next_ev = stream_->Peek(i);
+        if (info.done || !next_ev) continue;
+
+        if (next_ev->delta_time > ticks + info.playback_ticks) {
+            info.playback_ticks += ticks;
+            continue;
+        }
+
+        info.playback_ticks = 0;
+        ++info.current_event_index;
+        ApplyEvent(*next_ev, info);
+
+        if (next_ev->type == EventType::META && next_ev->meta_type == MetaType::TEMPO
+            && next_ev->usec_per_quarter_note != 0) {
+            stream_tempo_ = {
+                .tick = ticks_elapsed_,
+                .scaled_usec = ScaledUsecAt(ticks_elapsed_),
+                .usec_per_quarter_note = next_ev->usec_per_quarter_note
             };
-            break;
-        case EventType::NOTE_OFF:
-            if (next_ev.note_event.note > MAX_NOTE) break;
-            notes_[next_ev.note_event.note].note_on = false;
-            break;
-        case EventType::META:
-            switch (next_ev.meta_type) {
-            case MetaType::END_TRACK:
-                info.done = true;
-                break;
-            case MetaType::TEMPO:
-                ticks_per_second_ = midi_ptr_->ticks_per_quarter_note * 1000000.f
-                                  / next_ev.usec_per_quarter_note;
-                break;
-            default:
-                break;
-            }
-            break;
-        default:
-            break;
         }
+
+        // Frees the event's slot for the decoder
+        stream_->Pop(i);
     }
 
     return tb::ok;
@@ -316,23 +667,37 @@ void Player::PlayEvent(const Event& event)
         if (event.note_event.note > MAX_NOTE) return;
         notes_[event.note_event.note] = {
             .time = ticks_elapsed_,
+            .seconds = time_diff.count(),
             .velocity = event.note_event.velocity,
             .note_on = true
         };
         break;
     case EventType::NOTE_OFF:
         if (event.note_event.note > MAX_NOTE) return;
-        notes_[event.note_event.note].note_on = false;
+        Release(notes_[event.note_event.note], time_diff.count());
         break;
     default:
         break;
     }
 }
 
+// The end of a pending loop counts as an event, so that playback stops there
+// to wrap
 auto Player::TicksUntilNextEvent() const -> std::optional<Ticks>
+{
+    std::optional<Ticks> ticks = TicksUntilNextTrackEvent();
+    if (!LoopPending()) return ticks;
+
+    Ticks until_loop_end = loop_->end - ticks_elapsed_;
+    return ticks ? std::min(*ticks, until_loop_end) : until_loop_end;
+}
+
+auto Player::TicksUntilNextTrackEvent() const -> std::optional<Ticks>
 {
     if (!midi_ptr_) return std::nullopt;
 
+    if (stream_) return TicksUntilNextStreamEvent();
+
     Ticks shortest = std::numeric_limits<Ticks>::max();
     for (auto& [track, info] : tracks_) {
         if (info.done) continue;
@@ -347,6 +712,28 @@ auto Player::TicksUntilNextEvent() const -> std::optional<Ticks>
     return shortest;
 }
 
+auto Player::TicksUntilNextStreamEvent() const -> std::optional<Ticks>
+{
+    Ticks shortest = std::numeric_limits<Ticks>::max();
+    for (size_t i = 0; i < tracks_.size(); ++i) {
+        if (TrackDone(i)) continue;
+
+        // This track isn't decoded this far, so nothing can be played until the
+        // decoder catches up
+        const Event* next_ev = stream_->Peek(i);
+        if (!next_ev) return std::nullopt;
+
+        const TrackInfo& info = tracks_[i].second;
+        if (next_ev->delta_time - info.playback_ticks < shortest)
+            shortest = next_ev->delta_time - info.playback_ticks;
+    }
+
+    if (shortest == std::numeric_limits<Ticks>::max())
+        return std::nullopt;
+
+    return shortest;
+}
+
 auto Player::GetCurrentNotes() const -> const NoteMap&
 {
     return notes_;
@@ -355,13 +742,113 @@ auto Player::GetCurrentNotes() const -> const NoteMap&
 void Player::SetMIDI(const MIDI& midi)
 {
     ticks_elapsed_ = 0;
+    seconds_elapsed_ = 0;
     midi_ptr_ = &midi;
+    stream_ = nullptr;
+    loop_.reset();
+    ++timeline_version_;
+    ticks_per_second_ = midi.ticks_per_quarter_note * 1000000.f
+                      / midi.tempo_map.TempoAt(0).usec_per_quarter_note;
     tracks_.clear();
     for (const Track& track : midi.tracks) {
-        tracks_.emplace_back(&track, TrackInfo {});
+        tracks_.emplace_back(&track, TrackInfo { .done = track.events.empty() });
     }
 }
 
+// Tempo is taken from the stream's events as they play, as it has no tempo map
+void Player::SetStream(MIDIStream& stream)
+{
+    SetMIDI(stream.GetHeader());
+    stream_ = &stream;
+    stream_tempo_ = {
+        .tick = 0, .scaled_usec = 0,
+        .usec_per_quarter_note = DEFAULT_USEC_PER_QUARTER_NOTE
+    };
+    tracks_.assign(stream.TrackCount(), { nullptr, TrackInfo {} });
+}
+
+// Streams keep nothing already played, so can't be sought. The loop is set
+// aside while catching up, as wrapping at its end would seek again, and a
+// target at or past the end would go round forever. Such a target is left
+// outside the loop, which plays on from there.
+void Player::Seek(Ticks tick)
+{
+    if (!midi_ptr_ || stream_) return;
+
+    std::optional<LoopRegion> loop = std::exchange(loop_, std::nullopt);
+
+    const std::vector<Checkpoint>& checkpoints = midi_ptr_->checkpoints;
+    auto next = std::ranges::upper_bound(checkpoints, tick, {}, &Checkpoint::tick);
+
+    if (next == checkpoints.begin()) {
+        SetMIDI(*midi_ptr_);
+        notes_ = {};
+    } else {
+        RestoreCheckpoint(*(next - 1));
+    }
+
+    // Events on the target tick are played, as they would be when arriving there
+    // during normal playback
+    for (std::optional<Ticks> ticks = TicksUntilNextEvent();
+        ticks && ticks_elapsed_ + *ticks <= tick; ticks = TicksUntilNextEvent()) {
+        Advance().ignore_error();
+    }
+
+    AdvanceWithinGap(tick - ticks_elapsed_);
+    loop_ = loop;
+}
+
+// Moves part of the way towards the next event, which must not be passed
+void Player::AdvanceWithinGap(Ticks ticks)
+{
+    ticks_elapsed_ += ticks;
+    seconds_elapsed_ += ticks / GetTicksPerSecond();
+    for (auto& [track, info] : tracks_) {
+        if (!info.done)
+            info.playback_ticks += ticks;
+    }
+}
+
+auto Player::SaveCheckpoint() const -> Checkpoint
+{
+    Checkpoint checkpoint {
+        .tick = ticks_elapsed_,
+        .tracks = tb::with_capacity(tracks_.size()),
+        .ticks_per_second = ticks_per_second_,
+        .seconds = seconds_elapsed_
+    };
+
+    for (const auto& [track, info] : tracks_)
+        checkpoint.tracks.push_back(info);
+
+    for (uint8_t note = 0; note <= MAX_NOTE; ++note) {
+        if (notes_[note].note_on)
+            checkpoint.sounding_notes.emplace_back(note, notes_[note]);
+    }
+
+    return checkpoint;
+}
+
+void Player::RestoreCheckpoint(const Checkpoint& checkpoint)
+{
+    ticks_elapsed_ = checkpoint.tick;
+    ticks_per_second_ = checkpoint.ticks_per_second;
+    seconds_elapsed_ = checkpoint.seconds;
+    ++timeline_version_;
+
+    for (size_t i = 0; i < tracks_.size() && i < checkpoint.tracks.size(); ++i)
+        tracks_[i].second = checkpoint.tracks[i];
+
+    notes_ = {};
+    for (const auto& [note, info] : checkpoint.sounding_notes)
+        notes_[note] = info;
+}
+
+auto Player::GetMIDI() const -> const MIDI*
+{
+    return midi_ptr_;
+}
+
 auto Player::GetTicksElapsed() const -> Ticks
 {
     if (mode_ == PlayerMode::LIVE_PLAYBACK) {
@@ -371,14 +858,108 @@ auto Player::GetTicksElapsed() const -> Ticks
     return ticks_elapsed_;
 }
 
+auto Player::GetSecondsElapsed() const -> double
+{
+    if (mode_ == PlayerMode::LIVE_PLAYBACK) {
+        Seconds time_diff = Clock::now() - start_time_;
+        return time_diff.count();
+    }
+    return seconds_elapsed_;
+}
+
+// Scaled by the playback rate, so this is the rate at which ticks are played
 auto Player::GetTicksPerSecond() const -> float
 {
-    return ticks_per_second_;
+    return ticks_per_second_ * playback_rate_;
+}
+
+auto Player::GetPlaybackRate() const -> float
+{
+    return playback_rate_;
+}
+
+// The ticks of the current gap already played at the old rate are counted
+// before the rate changes, so the playback clock stays continuous
+void Player::SetPlaybackRate(float rate, Ticks ticks_into_gap)
+{
+    AdvanceWithinGap(ticks_into_gap);
+    playback_rate_ = rate;
+}
+
+void Player::SetLoop(const LoopRegion& loop)
+{
+    if (loop.start >= loop.end || loop.count == 0 || stream_) return;
+    loop_ = loop;
+}
+
+void Player::ClearLoop()
+{
+    loop_.reset();
+}
+
+auto Player::GetLoop() const -> const std::optional<LoopRegion>&
+{
+    return loop_;
+}
+
+auto Player::GetTimelineVersion() const -> uint32_t
+{
+    return timeline_version_;
+}
+
+auto Player::LoopPending() const -> bool
+{
+    return loop_ && midi_ptr_ && ticks_elapsed_ < loop_->end;
+}
+
+void Player::WrapLoop()
+{
+    Ticks start = loop_->start;
+    if (loop_->count != LOOP_FOREVER && --loop_->count == 0)
+        loop_.reset();
+
+    Seek(start);
 }
 
 auto Player::Done() const -> bool
 {
-    return std::ranges::all_of(tracks_, [] (auto& pair) { return pair.second.done; });
+    if (LoopPending()) return false;
+    if (!stream_)
+        return std::ranges::all_of(tracks_, [] (auto& pair) { return pair.second.done; });
+
+    for (size_t i = 0; i < tracks_.size(); ++i) {
+        if (!TrackDone(i)) return false;
+    }
+    return true;
+}
+
+// Exact time at a tick. Within a stream, only ticks from the last tempo change
+// played on are known.
+auto Player::ScaledUsecAt(Ticks tick) const -> uint64_t
+{
+    if (!stream_)
+        return midi_ptr_->tempo_map.ScaledUsecAt(tick);
+
+    return stream_tempo_.scaled_usec
+         + (tick - stream_tempo_.tick) * stream_tempo_.usec_per_quarter_note;
+}
+
+auto Player::TicksAtScaledUsec(uint64_t scaled_usec) const -> Ticks
+{
+    if (!stream_)
+        return midi_ptr_->tempo_map.TicksAtScaledUsec(scaled_usec);
+
+    if (scaled_usec <= stream_tempo_.scaled_usec)
+        return stream_tempo_.tick;
+
+    return stream_tempo_.tick
+         + (scaled_usec - stream_tempo_.scaled_usec) / stream_tempo_.usec_per_quarter_note;
+}
+
+// Fully played, or for a stream also decoded to its end without an end event
+auto Player::TrackDone(size_t track) const -> bool
+{
+    return tracks_[track].second.done || (stream_ && stream_->Ended(track));
 }
 
 }
@@ -3,7 +3,9 @@
 #include <algorithm>
 #include <chrono>
 #include <iterator>
+#include <optional>
 #include <ranges>
+#include <span>
 #include <string_view>
 #include <type_traits>
 #include <unordered_map>
@@ -22,6 +24,9 @@ constexpr float MAX_VELOCITY = std::numeric_limits<int8_t>::max();
 
 using Ticks = uint64_t;
 
+// Tempo in effect until the first tempo event, 120 beats per minute
+constexpr uint32_t DEFAULT_USEC_PER_QUARTER_NOTE = 500000;
+
 enum class Format
 {
     SINGLE_TRACK = 0, MULTI_TRACK = 1, MULTI_TRACK_INDEPENDENT = 2
@@ -46,7 +51,8 @@ enum class EventType : uint8_t
 
 enum class MetaType : uint8_t
 {
-    SEQUENCE_OR_TRACK_NAME = 0x03, END_TRACK = 0x2F, TEMPO = 0x51
+    SEQUENCE_OR_TRACK_NAME = 0x03, END_TRACK = 0x2F, TEMPO = 0x51,
+    TIME_SIGNATURE = 0x58
 };
 
 enum class CodeIndexNumber : uint8_t
@@ -96,6 +102,20 @@ struct Error
     }
 };
 
+struct TimeSignature
+{
+    uint8_t numerator;
+    uint8_t denominator_power;      // Denominator is 2 to this power
+    uint8_t clocks_per_click;       // MIDI clocks, 24 to a quarter note
+    uint8_t thirty_seconds_per_quarter;
+};
+
+// In effect until the first time signature event
+constexpr TimeSignature DEFAULT_TIME_SIGNATURE {
+    .numerator = 4, .denominator_power = 2, .clocks_per_click = 24,
+    .thirty_seconds_per_quarter = 8
+};
+
 struct Event
 {
     uint32_t delta_time;
@@ -109,6 +129,7 @@ struct Event
         } note_event;
 
         uint32_t usec_per_quarter_note; // Tempo
+        TimeSignature time_signature;
     };
 };
 
@@ -117,9 +138,40 @@ struct Track
     std::vector<Event> events;
 
     static auto FromStream(FILE* file, uint32_t track_size) -> tb::result<Track, Error>;
+    // Reads a track chunk's header, giving the size of the events after it
+    static auto ChunkSize(FILE* file) -> tb::result<uint32_t, Error>;
     void ToNoteSeries(std::vector<uint8_t>& output) const;
 };
 
+// Decodes a track chunk a run of events at a time, so a track can be parsed
+// piece by piece in turn with other tracks
+class TrackDecoder
+{
+public:
+    TrackDecoder(size_t start, uint32_t track_size);
+
+    // Appends the events kept from the chunk. The file must be at Position().
+    auto Read(FILE* file, std::vector<Event>& events,
+        size_t max_events = std::numeric_limits<size_t>::max()) -> tb::error<Error>;
+    auto Position() const -> size_t;
+    auto Finished() const -> bool;
+
+private:
+    size_t position_, end_;
+    EventType running_type_ {};
+    uint32_t skipped_ticks_ = 0;    // Carried by events that aren't kept
+};
+
+// The MThd chunk
+struct Header
+{
+    Format format;
+    uint16_t track_count;
+    uint16_t ticks_per_quarter_note;
+
+    static auto FromStream(FILE* file) -> tb::result<Header, Error>;
+};
+
 constexpr size_t BEFORE_FIRST_EVENT = std::numeric_limits<size_t>::max();
 
 struct TrackInfo
@@ -132,8 +184,78 @@ struct TrackInfo
 struct NoteInfo
 {
     Ticks time;
+    double seconds;     // Playback time of the note on
     uint8_t velocity;
     bool note_on = false;
+    bool released = false;
+    double seconds_off = 0;     // Playback time of the note off, once released
+};
+
+using NoteMap = std::array<NoteInfo, MAX_NOTE + 1>;
+
+// Events advanced between checkpoints, bounding the work done by a seek
+constexpr size_t CHECKPOINT_INTERVAL = 128;
+
+// Complete Player state at a tick, so that seeking only replays from here
+struct Checkpoint
+{
+    Ticks tick;
+    std::vector<TrackInfo> tracks;
+    std::vector<std::pair<uint8_t, NoteInfo>> sounding_notes;
+    float ticks_per_second;
+    double seconds;
+};
+
+constexpr unsigned LOOP_FOREVER = std::numeric_limits<unsigned>::max();
+
+// Ticks in [start, end) are repeated, wrapping to start on reaching end
+struct LoopRegion
+{
+    Ticks start;
+    Ticks end;
+    unsigned count = LOOP_FOREVER;  // Wraps remaining before playing on
+};
+
+// A metronome click
+struct Beat
+{
+    Ticks tick;
+    bool downbeat;  // First beat of a bar
+};
+
+struct TempoChange
+{
+    Ticks tick;
+    // Time elapsed at tick in microseconds, multiplied by ticks per quarter note
+    // so that it is exact
+    uint64_t scaled_usec;
+    uint32_t usec_per_quarter_note;
+};
+
+// Every tempo change in a MIDI with its absolute time, so conversions between
+// ticks and time are a binary search rather than a replay
+class TempoMap
+{
+public:
+    TempoMap() = default;
+    TempoMap(std::span<const Track> tracks, uint16_t ticks_per_quarter_note);
+    TempoMap(std::vector<TempoChange> changes, uint16_t ticks_per_quarter_note);
+
+    auto TempoAt(Ticks tick) const -> const TempoChange&;
+    auto TicksToSeconds(Ticks tick) const -> double;
+    auto SecondsToTicks(double seconds) const -> Ticks;
+    auto TicksToSamples(Ticks tick, uint32_t sample_rate) const -> uint64_t;
+    auto SamplesToTicks(uint64_t samples, uint32_t sample_rate) const -> Ticks;
+    auto GetChanges() const -> std::span<const TempoChange>;
+    auto ScaledUsecAt(Ticks tick) const -> uint64_t;
+    auto TicksAtScaledUsec(uint64_t scaled_usec) const -> Ticks;
+
+private:
+    std::vector<TempoChange> changes_ {
+        { .tick = 0, .scaled_usec = 0,
+          .usec_per_quarter_note = DEFAULT_USEC_PER_QUARTER_NOTE }
+    };
+    uint16_t ticks_per_quarter_note_ = 1;
 };
 
 struct MIDI
@@ -141,15 +263,25 @@ struct MIDI
     std::vector<Track> tracks;
     Format format;
     uint16_t ticks_per_quarter_note;
+    TempoMap tempo_map;
+    Ticks length = 0;   // Ticks until the end of the longest track
+    std::vector<Checkpoint> checkpoints;
+    std::vector<Beat> beats;    // Clicks from the time signatures, up to length
+
+    auto Duration() const -> double;
+    auto MemoryUsage() const -> size_t;     // Bytes, including what it owns
 
     static auto FromFile(std::string_view path) -> tb::result<MIDI, Error>;
     static auto FromStream(FILE* file) -> tb::result<MIDI, Error>;
+    static auto FromMemory(std::span<const uint8_t> bytes) -> tb::result<MIDI, Error>;
 };
 
+class MIDIStream;
+
 class Player
 {
 public:
-    using NoteMap = std::array<NoteInfo, MAX_NOTE + 1>;
+    using NoteMap = midi::NoteMap;
     Player(PlayerMode mode = PlayerMode::FILE_PLAYBACK);
 
     auto Advance() -> tb::error<EndOfMIDIError>;
@@ -157,21 +289,54 @@ public:
     auto TicksUntilNextEvent() const -> std::optional<Ticks>;
     auto GetCurrentNotes() const -> const NoteMap&;
     auto GetTicksElapsed() const -> Ticks;
+    auto GetSecondsElapsed() const -> double;
     auto GetTicksPerSecond() const -> float;
+    auto GetPlaybackRate() const -> float;
+    void SetPlaybackRate(float rate, Ticks ticks_into_gap);
     void SetMIDI(const MIDI& midi);
+    void SetStream(MIDIStream& stream);
+    void Seek(Ticks tick);
+    auto SaveCheckpoint() const -> Checkpoint;
+    void RestoreCheckpoint(const Checkpoint& checkpoint);
+    auto GetMIDI() const -> const MIDI*;
+    void SetLoop(const LoopRegion& loop);
+    void ClearLoop();
+    auto GetLoop() const -> const std::optional<LoopRegion>&;
+    auto GetTimelineVersion() const -> uint32_t;
     auto Done() const -> bool;
+    auto ScaledUsecAt(Ticks tick) const -> uint64_t;
+    auto TicksAtScaledUsec(uint64_t scaled_usec) const -> Ticks;
 
 private:
+    auto AdvanceStream() -> tb::error<EndOfMIDIError>;
+    auto TicksUntilNextStreamEvent() const -> std::optional<Ticks>;
+    void ApplyEvent(const Event& event, TrackInfo& info);
+    auto TrackDone(size_t track) const -> bool;
+    void AdvanceWithinGap(Ticks ticks);
+    auto TicksUntilNextTrackEvent() const -> std::optional<Ticks>;
+    auto LoopPending() const -> bool;
+    void WrapLoop();
+
     using Clock = std::chrono::high_resolution_clock;
     using TimePoint = std::chrono::time_point<Clock>;
     using Seconds = std::chrono::duration<double>;
 
     NoteMap notes_ = {};
-    std::vector<std::pair<const Track*, TrackInfo>> tracks_;
+    std::vector<std::pair<const Track*, TrackInfo>> tracks_;    // No Tracks when streaming
     const MIDI* midi_ptr_ = nullptr;
+    MIDIStream* stream_ = nullptr;
+    // Tempo change last played from a stream, which has no tempo map
+    TempoChange stream_tempo_ {
+        .tick = 0, .scaled_usec = 0,
+        .usec_per_quarter_note = DEFAULT_USEC_PER_QUARTER_NOTE
+    };
     TimePoint start_time_ = Clock::now();
     Ticks ticks_elapsed_ = 0;
+    double seconds_elapsed_ = 0;
     float ticks_per_second_ = 960.f;
+    float playback_rate_ = 1.f;
+    std::optional<LoopRegion> loop_;
+    uint32_t timeline_version_ = 0;     // Changes whenever playback jumps
     PlayerMode mode_;
 public:
     uint8_t transposition_offset_ = 0;
@@ -0,0 +1,118 @@
+#include "midistream.h"
+
+namespace midi
+{
+
+MIDIStream::~MIDIStream()
+{
+    stopping_.store(true, std::memory_order_release);
+    refill_requests_.fetch_add(1, std::memory_order_release);
+    refill_requests_.notify_one();
+
+    if (decoder_.joinable())
+        decoder_.join();
+    if (file_)
+        fclose(file_);
+}
+
+auto MIDIStream::Open(std::string_view path) -> tb::error<Error>
+{
+    path_ = path;
+    file_ = fopen(path_.c_str(), "rb");
+    if (!file_)
+        return Error { Error::FILE_NOT_FOUND };
+
+    auto header = Header::FromStream(file_);
+    if (header.is_error())
+        return header.get_error();
+
+    header_.format = header.get_unchecked().format;
+    header_.ticks_per_quarter_note = header.get_unchecked().ticks_per_quarter_note;
+
+    // Only the chunk headers are read here, skipping over each track's events
+    size_t track_count = header.get_unchecked().track_count;
+    for (size_t i = 0; i < track_count; ++i) {
+        auto track_size = Track::ChunkSize(file_);
+        if (track_size.is_error())
+            return track_size.get_error();
+
+        size_t start = ftell(file_);
+        decoders_.emplace_back(start, track_size.get_unchecked());
+        fseek(file_, track_size.get_unchecked(), SEEK_CUR);
+    }
+
+    buffers_ = std::make_unique<EventBuffer[]>(track_count);
+    finished_ = std::make_unique<std::atomic<bool>[]>(track_count);
+
+    if (Fill())
+        decoder_ = std::thread([this] { Run(); });
+
+    return tb::ok;
+}
+
+// Tops up every buffer that has drained by half, a track at a time so the file
+// is read in runs. Returns false once every track is decoded.
+auto MIDIStream::Fill() -> bool
+{
+    bool decoding = false;
+
+    for (size_t i = 0; i < decoders_.size(); ++i) {
+        if (finished_[i].load(std::memory_order_relaxed)) continue;
+        decoding = true;
+
+        EventBuffer& buffer = buffers_[i];
+        if (buffer.Space() < STREAM_BUFFER_EVENTS / 2) continue;
+
+        TrackDecoder& decoder = decoders_[i];
+        fseek(file_, decoder.Position(), SEEK_SET);
+
+        batch_.clear();
+        auto result = decoder.Read(file_, batch_, buffer.Space());
+        for (const Event& event : batch_)
+            buffer.Push(event).ignore_error();
+
+        // The track plays up to a bad event, while the others play on
+        if (result.is_error()) {
+            tb::print("Couldn't stream track {} of '{}' past byte {}: {}\n", i, path_,
+                result.get_error().byte_position, result.get_error().What());
+        }
+
+        if (result.is_error() || decoder.Finished())
+            finished_[i].store(true, std::memory_order_release);
+    }
+
+    return decoding;
+}
+
+// Sleeps until the Player drains a buffer to half. Requests are counted rather
+// than flagged, so one made while Fill runs still wakes the next wait.
+void MIDIStream::Run()
+{
+    uint32_t seen = refill_requests_.load(std::memory_order_acquire);
+
+    for (;;) {
+        refill_requests_.wait(seen, std::memory_order_acquire);
+        seen = refill_requests_.load(std::memory_order_acquire);
+
+        if (stopping_.load(std::memory_order_acquire) || !Fill()) return;
+    }
+}
+
+auto MIDIStream::GetHeader() const -> const MIDI&
+{
+    return header_;
+}
+
+auto MIDIStream::TrackCount() const -> size_t
+{
+    return decoders_.size();
+}
+
+auto MIDIStream::MemoryUsage() const -> size_t
+{
+    return sizeof(MIDIStream) + header_.MemoryUsage() - sizeof(MIDI)
+         + decoders_.capacity() * sizeof(TrackDecoder)
+         + decoders_.size() * (sizeof(EventBuffer) + sizeof(std::atomic<bool>));
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "midi.h"
+#include "queue.h"
+
+#include <tb/tb.h>
+
+namespace midi
+{
+
+// Events decoded ahead of playback, per track. The decoder tops up a buffer
+// once it has drained by half.
+constexpr size_t STREAM_BUFFER_EVENTS = 1024;
+
+// A MIDI parsed while it plays, for files long enough that parsing them whole
+// would hold up the first note. Each track is decoded from its own place in
+// the file into a ring buffer, which a background thread keeps ahead of the
+// Player. Played events leave their buffers, so memory doesn't grow with the
+// length of the file. Nothing played is kept, so a stream can't be sought or
+// looped, and it has no beats for the metronome.
+class MIDIStream
+{
+public:
+    MIDIStream() = default;
+    ~MIDIStream();
+
+    MIDIStream(const MIDIStream&) = delete;
+    MIDIStream& operator=(const MIDIStream&) = delete;
+
+    // Reads the header and fills every track's buffer before the decoder
+    // starts, so playback can begin as soon as this returns
+    auto Open(std::string_view path) -> tb::error<Error>;
+
+    // Format and timing, without tracks
+    auto GetHeader() const -> const MIDI&;
+    auto TrackCount() const -> size_t;
+    auto MemoryUsage() const -> size_t;     // Bytes, including what it owns
+
+    // Player only, and defined here so its per-event calls inline. Null when
+    // the track's next event isn't decoded yet.
+    auto Peek(size_t track) const -> const Event*
+    {
+        return buffers_[track].Peek();
+    }
+
+    // Wakes the decoder as the buffer drains to half. A futex wake, which
+    // doesn't block, and only made once per refill.
+    void Pop(size_t track)
+    {
+        EventBuffer& buffer = buffers_[track];
+        buffer.Pop();
+
+        if (buffer.Size() == STREAM_BUFFER_EVENTS / 2) {
+            refill_requests_.fetch_add(1, std::memory_order_release);
+            refill_requests_.notify_one();
+        }
+    }
+
+    // Decoded to the end and fully played. Checked in this order, as all that
+    // is decoded is pushed before the track is marked finished.
+    auto Ended(size_t track) const -> bool
+    {
+        return finished_[track].load(std::memory_order_acquire)
+            && buffers_[track].Peek() == nullptr;
+    }
+
+private:
+    using EventBuffer = SPSCQueue<Event, STREAM_BUFFER_EVENTS>;
+
+    auto Fill() -> bool;
+    void Run();
+
+    std::string path_;
+    FILE* file_ = nullptr;
+    MIDI header_ {};
+    std::vector<TrackDecoder> decoders_;    // Decoding thread only, once started
+    std::vector<Event> batch_;
+    std::unique_ptr<EventBuffer[]> buffers_;
+    std::unique_ptr<std::atomic<bool>[]> finished_;     // No more to decode
+
+    std::thread decoder_;
+    std::atomic<uint32_t> refill_requests_ = 0;     // Waited on by the decoder
+    std::atomic<bool> stopping_ = false;
+};
+
+}
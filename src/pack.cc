@@ -0,0 +1,307 @@
+#include "pack.h"
+
+#include "cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace pack
+{
+
+constexpr char PACK_MAGIC[4] = { 'W', 'T', 'E', 'P' };
+constexpr uint32_t PACK_VERSION = 1;
+
+// Compressed bytes are read this much at a time while inflating
+constexpr size_t READ_CHUNK_SIZE = 64 * 1024;
+
+// Entries claiming to inflate past either limit are taken as damage, before
+// anything is allocated for them. Deflate can't expand by more than about
+// 1032 to 1, and no manifest or MIDI comes near the size limit.
+constexpr uint64_t MAX_INFLATE_RATIO = 1032;
+constexpr uint64_t MAX_ENTRY_SIZE = 256 * 1024 * 1024;
+
+// Followed by every file's compressed bytes, then the index
+struct PackHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t index_size;
+};
+
+// One per entry in the index, each followed by its name and padded to 8 bytes
+struct IndexRecord
+{
+    uint64_t offset;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t content_hash;
+    uint32_t name_length;
+    uint32_t reserved;
+};
+
+constexpr size_t RECORD_ALIGNMENT = 8;
+
+auto ReadExactly(int fd, void* dest, size_t size, uint64_t offset) -> bool
+{
+    auto* bytes = static_cast<uint8_t*>(dest);
+    while (size > 0) {
+        ssize_t count = pread(fd, bytes, size, offset);
+        if (count <= 0) return false;
+        bytes += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+ResourcePack::ResourcePack(ResourcePack&& other)
+{
+    *this = std::move(other);
+}
+
+ResourcePack& ResourcePack::operator=(ResourcePack&& other)
+{
+    std::swap(fd_, other.fd_);
+    std::swap(entries_, other.entries_);
+    std::swap(entry_indices_, other.entry_indices_);
+    return *this;
+}
+
+ResourcePack::~ResourcePack()
+{
+    if (fd_ != -1)
+        close(fd_);
+}
+
+auto ResourcePack::FromFile(std::string_view path) -> tb::result<ResourcePack, Error>
+{
+    ResourcePack pack;
+    pack.fd_ = open(std::string(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (pack.fd_ == -1)
+        return Error { Error::FILE_NOT_FOUND };
+
+    PackHeader header;
+    if (!ReadExactly(pack.fd_, &header, sizeof(header), 0)
+        || memcmp(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0
+        || header.version != PACK_VERSION)
+        return Error { Error::NOT_A_PACK };
+
+    // Every size is checked against the file before it is trusted, as a damaged
+    // pack can hold anything
+    struct stat info;
+    if (fstat(pack.fd_, &info) != 0)
+        return Error { Error::BAD_INDEX };
+
+    auto file_size = static_cast<uint64_t>(info.st_size);
+    if (header.index_offset < sizeof(header) || header.index_offset > file_size
+        || header.index_size > file_size - header.index_offset
+        || header.entry_count > header.index_size / sizeof(IndexRecord))
+        return Error { Error::BAD_INDEX };
+
+    std::vector<uint8_t> index(header.index_size);
+    if (!ReadExactly(pack.fd_, index.data(), index.size(), header.index_offset))
+        return Error { Error::BAD_INDEX };
+
+    pack.entries_.reserve(header.entry_count);
+    for (size_t position = 0, i = 0; i < header.entry_count; ++i) {
+        IndexRecord record;
+        if (position + sizeof(record) > index.size())
+            return Error { Error::BAD_INDEX };
+
+        memcpy(&record, index.data() + position, sizeof(record));
+        position += sizeof(record);
+        if (position + record.name_length > index.size()
+            || record.offset < sizeof(header) || record.offset > header.index_offset
+            || record.compressed_size > header.index_offset - record.offset
+            || record.size > MAX_ENTRY_SIZE
+            || record.size / MAX_INFLATE_RATIO > record.compressed_size)
+            return Error { Error::BAD_INDEX };
+
+        std::string name(reinterpret_cast<const char*>(index.data() + position),
+            record.name_length);
+        position = (position + record.name_length + RECORD_ALIGNMENT - 1)
+                 & ~(RECORD_ALIGNMENT - 1);
+
+        pack.entry_indices_.emplace(name, pack.entries_.size());
+        pack.entries_.push_back({
+            .name = std::move(name),
+            .offset = record.offset,
+            .compressed_size = record.compressed_size,
+            .size = record.size,
+            .content_hash = record.content_hash
+        });
+    }
+
+    if (pack.entries_.empty())
+        return Error { Error::BAD_INDEX };
+
+    return pack;
+}
+
+auto ResourcePack::IsPack(std::string_view path) -> bool
+{
+    FILE* file = fopen(std::string(path).c_str(), "rb");
+    if (file == nullptr) return false;
+
+    char magic[sizeof(PACK_MAGIC)];
+    bool is_pack = fread(magic, sizeof(magic), 1, file) == 1
+                && memcmp(magic, PACK_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return is_pack;
+}
+
+auto ResourcePack::Contains(std::string_view name) const -> bool
+{
+    return entry_indices_.contains(std::string(name));
+}
+
+auto ResourcePack::Read(std::string_view name) const
+    -> tb::result<std::vector<uint8_t>, Error>
+{
+    auto entry = entry_indices_.find(std::string(name));
+    if (entry == entry_indices_.end())
+        return Error { Error::ENTRY_NOT_FOUND };
+
+    return Inflate(entries_[entry->second]);
+}
+
+auto ResourcePack::ReadManifest() const -> tb::result<std::vector<uint8_t>, Error>
+{
+    return Inflate(entries_.front());
+}
+
+auto ResourcePack::GetEntries() const -> std::span<const Entry>
+{
+    return entries_;
+}
+
+auto ResourcePack::LoadMIDI(std::string_view name, uint64_t& content_hash) const
+    -> tb::result<midi::MIDI, midi::Error>
+{
+    auto entry = entry_indices_.find(std::string(name));
+    if (entry == entry_indices_.end())
+        return midi::Error { midi::Error::FILE_NOT_FOUND };
+
+    auto bytes = Inflate(entries_[entry->second]);
+    if (bytes.is_error())
+        return midi::Error { midi::Error::NO_HEADER_FOUND };
+
+    content_hash = entries_[entry->second].content_hash;
+    return midi::MIDI::FromMemory(bytes.get_unchecked());
+}
+
+// Reads the compressed bytes a chunk at a time, inflating each straight into
+// the output, so only the inflated file is ever held whole
+auto ResourcePack::Inflate(const Entry& entry) const
+    -> tb::result<std::vector<uint8_t>, Error>
+{
+    std::vector<uint8_t> output(entry.size);
+    uint8_t chunk[READ_CHUNK_SIZE];
+
+    z_stream stream {};
+    if (inflateInit(&stream) != Z_OK)
+        return Error { Error::CORRUPT_ENTRY };
+
+    tb::scoped_guard end_stream = [&stream] { inflateEnd(&stream); };
+
+    stream.next_out = output.data();
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    int status = Z_OK;
+    for (uint64_t read = 0; status == Z_OK && read < entry.compressed_size;) {
+        size_t count = std::min<uint64_t>(sizeof(chunk), entry.compressed_size - read);
+        if (!ReadExactly(fd_, chunk, count, entry.offset + read))
+            return Error { Error::CORRUPT_ENTRY };
+        read += count;
+
+        stream.next_in = chunk;
+        stream.avail_in = static_cast<uInt>(count);
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status == Z_BUF_ERROR && stream.avail_out > 0)
+            status = Z_OK;
+    }
+
+    // The zlib trailer's checksum catches damaged storage
+    if (status != Z_STREAM_END || stream.total_out != entry.size)
+        return Error { Error::CORRUPT_ENTRY };
+
+    return output;
+}
+
+// Written to a temporary file first, so a pack being replaced is never left
+// half written
+auto WritePack(std::string_view path, std::span<const File> files) -> tb::error<Error>
+{
+    std::string temporary_path = std::string(path) + ".tmp";
+    FILE* file = fopen(temporary_path.c_str(), "wb");
+    if (file == nullptr)
+        return Error { Error::WRITE_ERROR };
+
+    bool written = false;
+    tb::scoped_guard finish = [&] {
+        fclose(file);
+        if (!written) unlink(temporary_path.c_str());
+    };
+
+    PackHeader header {
+        .version = PACK_VERSION,
+        .entry_count = static_cast<uint32_t>(files.size())
+    };
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        return Error { Error::WRITE_ERROR };
+
+    std::vector<uint8_t> index;
+    uint64_t offset = sizeof(header);
+
+    for (const File& packed : files) {
+        uLongf compressed_size = compressBound(packed.bytes.size());
+        std::vector<uint8_t> compressed(compressed_size);
+        if (compress2(compressed.data(), &compressed_size, packed.bytes.data(),
+                packed.bytes.size(), Z_BEST_COMPRESSION) != Z_OK)
+            return Error { Error::WRITE_ERROR };
+
+        if (fwrite(compressed.data(), 1, compressed_size, file) != compressed_size)
+            return Error { Error::WRITE_ERROR };
+
+        std::string name = std::filesystem::path(packed.name).lexically_normal();
+        IndexRecord record {
+            .offset = offset,
+            .compressed_size = compressed_size,
+            .size = packed.bytes.size(),
+            .content_hash = HashBytes(packed.bytes),
+            .name_length = static_cast<uint32_t>(name.size())
+        };
+        offset += compressed_size;
+
+        auto* record_bytes = reinterpret_cast<const uint8_t*>(&record);
+        index.insert(index.end(), record_bytes, record_bytes + sizeof(record));
+        index.insert(index.end(), name.begin(), name.end());
+        index.resize((index.size() + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1));
+    }
+
+    header.index_offset = offset;
+    header.index_size = index.size();
+
+    if (fwrite(index.data(), 1, index.size(), file) != index.size()
+        || fseek(file, 0, SEEK_SET) != 0
+        || fwrite(&header, sizeof(header), 1, file) != 1
+        || fflush(file) != 0
+        || rename(temporary_path.c_str(), std::string(path).c_str()) != 0)
+        return Error { Error::WRITE_ERROR };
+
+    written = true;
+    return tb::ok;
+}
+
+}
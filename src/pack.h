@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "midi.h"
+
+#include <tb/tb.h>
+
+// A single compressed file holding an exercise manifest and every MIDI it uses,
+// for stations that install packs rather than loose files. Each file is
+// deflated separately and found through an index at the end of the pack, so
+// one MIDI can be inflated on its own, straight into memory for the parser.
+namespace pack
+{
+
+struct Error
+{
+    enum ErrorType
+    {
+        FILE_NOT_FOUND, NOT_A_PACK, BAD_INDEX, ENTRY_NOT_FOUND, CORRUPT_ENTRY,
+        WRITE_ERROR
+    };
+
+    ErrorType type;
+
+    constexpr auto What() const -> std::string_view
+    {
+        switch (type) {
+        case FILE_NOT_FOUND: return "file not found";
+        case NOT_A_PACK: return "not a resource pack";
+        case BAD_INDEX: return "bad pack index";
+        case ENTRY_NOT_FOUND: return "not in pack";
+        case CORRUPT_ENTRY: return "corrupt pack entry";
+        case WRITE_ERROR: return "could not write pack";
+        default: return "unknown error";
+        }
+    }
+};
+
+// Where a file's compressed bytes are, and what they inflate to
+struct Entry
+{
+    std::string name;
+    uint64_t offset, compressed_size, size;
+    uint64_t content_hash;
+};
+
+class ResourcePack
+{
+public:
+    ResourcePack() = default;
+    ResourcePack(const ResourcePack&) = delete;
+    ResourcePack& operator=(const ResourcePack&) = delete;
+    ResourcePack(ResourcePack&& other);
+    ResourcePack& operator=(ResourcePack&& other);
+    ~ResourcePack();
+
+    static auto FromFile(std::string_view path) -> tb::result<ResourcePack, Error>;
+    static auto IsPack(std::string_view path) -> bool;
+
+    // Entries are found by their paths as the manifest gives them, normalised
+    auto Contains(std::string_view name) const -> bool;
+    auto Read(std::string_view name) const -> tb::result<std::vector<uint8_t>, Error>;
+    auto ReadManifest() const -> tb::result<std::vector<uint8_t>, Error>;
+    auto GetEntries() const -> std::span<const Entry>;
+
+    // Safe on any thread, as reads don't move a shared file position
+    auto LoadMIDI(std::string_view name, uint64_t& content_hash) const
+        -> tb::result<midi::MIDI, midi::Error>;
+
+private:
+    auto Inflate(const Entry& entry) const -> tb::result<std::vector<uint8_t>, Error>;
+
+    int fd_ = -1;
+    std::vector<Entry> entries_;    // The manifest first
+    std::unordered_map<std::string, size_t> entry_indices_;
+};
+
+struct File
+{
+    std::string name;
+    std::vector<uint8_t> bytes;
+};
+
+// The first file is taken as the manifest
+auto WritePack(std::string_view path, std::span<const File> files) -> tb::error<Error>;
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+#include <tb/tb.h>
+
+struct QueueFullError {};
+
+// Lock-free ring buffer for exactly one producer thread and one consumer
+// thread. Neither side ever blocks or allocates, so the audio thread can be
+// either end.
+template<typename T, size_t CAPACITY>
+class SPSCQueue
+{
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "capacity must be a power of two");
+
+public:
+    // Producer only
+    auto Push(const T& value) -> tb::error<QueueFullError>
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == CAPACITY)
+            return QueueFullError {};
+
+        items_[tail & (CAPACITY - 1)] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return tb::ok;
+    }
+
+    // Consumer only
+    auto Pop() -> std::optional<T>
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return std::nullopt;
+
+        T value = items_[head & (CAPACITY - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+    // Consumer only. The value Pop would return, left in place, or null.
+    auto Peek() const -> const T*
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &items_[head & (CAPACITY - 1)];
+    }
+
+    // Consumer only. The producer may add more at any time.
+    auto Size() const -> size_t
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_relaxed);
+    }
+
+    // Producer only. The consumer may free more at any time.
+    auto Space() const -> size_t
+    {
+        return CAPACITY - (tail_.load(std::memory_order_relaxed)
+                           - head_.load(std::memory_order_acquire));
+    }
+
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    std::array<T, CAPACITY> items_ {};
+    // Kept on separate cache lines so the two threads don't contend
+    alignas(CACHE_LINE) std::atomic<size_t> head_ = 0;
+    alignas(CACHE_LINE) std::atomic<size_t> tail_ = 0;
+};
@@ -0,0 +1,118 @@
+#include "realtime.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__SSE__)
+#include <pmmintrin.h>
+#include <xmmintrin.h>
+#endif
+
+#include <cerrno>
+#include <optional>
+
+namespace realtime
+{
+
+// Decaying envelopes and filter states otherwise spend their tails in
+// denormals, which are many times slower on most CPUs
+void FlushDenormals()
+{
+#if defined(__SSE__)
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+#elif defined(__aarch64__)
+    uint64_t fpcr;
+    asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+    asm volatile("msr fpcr, %0" :: "r"(fpcr | (1ull << 24)));
+#endif
+}
+
+auto RaiseThreadPriority() -> tb::error<Error>
+{
+    sched_param param { .sched_priority = AUDIO_THREAD_PRIORITY };
+    if (int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param); err != 0)
+        return Error { Error::PRIORITY_DENIED, err };
+
+    return tb::ok;
+}
+
+// Locking faults every page in, so the callback never takes a page fault on
+// first touch
+auto LockMemory(std::span<const std::byte> region) -> tb::error<Error>
+{
+    if (region.empty()) return tb::ok;
+
+    if (mlock(region.data(), region.size()) != 0)
+        return Error { Error::LOCK_FAILED, errno };
+
+    return tb::ok;
+}
+
+void CallbackStats::Record(std::chrono::nanoseconds duration)
+{
+    auto nsec = static_cast<uint64_t>(duration.count());
+    size_t bucket = std::min<uint64_t>(nsec / NSEC_PER_BUCKET, BUCKET_COUNT - 1);
+
+    histogram_[bucket].fetch_add(1, std::memory_order_relaxed);
+    calls_.fetch_add(1, std::memory_order_relaxed);
+
+    if (nsec > max_nsec_.load(std::memory_order_relaxed))
+        max_nsec_.store(nsec, std::memory_order_relaxed);
+}
+
+void CallbackStats::SetRealtimeThread(bool realtime_thread)
+{
+    realtime_thread_.store(realtime_thread, std::memory_order_relaxed);
+}
+
+// Upper edge of the bucket holding the percentile
+auto CallbackStats::Percentile(double fraction) const -> std::chrono::microseconds
+{
+    auto target = static_cast<uint64_t>(fraction * calls_.load(std::memory_order_relaxed));
+    uint64_t seen = 0;
+
+    for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+        seen += histogram_[bucket].load(std::memory_order_relaxed);
+        if (seen > target)
+            return std::chrono::microseconds((bucket + 1) * NSEC_PER_BUCKET / 1000);
+    }
+
+    return std::chrono::microseconds(BUCKET_COUNT * NSEC_PER_BUCKET / 1000);
+}
+
+void CallbackStats::Report(std::string_view name) const
+{
+    uint64_t calls = calls_.load(std::memory_order_relaxed);
+    if (calls == 0) return;
+
+    tb::print("{} callback{}: {} calls, p50 {}us, p99 {}us, p99.9 {}us, max {}us\n",
+        name, realtime_thread_.load(std::memory_order_relaxed) ? " (real-time)" : "",
+        calls, Percentile(0.5).count(), Percentile(0.99).count(),
+        Percentile(0.999).count(), max_nsec_.load(std::memory_order_relaxed) / 1000);
+}
+
+CallbackScope::CallbackScope(CallbackStats& stats, bool realtime) : stats_(stats)
+{
+    // Set once prepared, to whether the thread got real-time priority
+    thread_local std::optional<bool> realtime_thread;
+
+    if (realtime) {
+        if (!realtime_thread) {
+            FlushDenormals();
+            realtime_thread = !RaiseThreadPriority().is_error();
+        }
+        stats.SetRealtimeThread(*realtime_thread);
+    }
+
+    start_ = std::chrono::steady_clock::now();
+}
+
+CallbackScope::~CallbackScope()
+{
+    stats_.Record(std::chrono::steady_clock::now() - start_);
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <tb/tb.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <span>
+#include <string_view>
+
+// Opt-in hardening for the audio threads, and timing of every callback so its
+// effect on the tail latency can be measured
+namespace realtime
+{
+
+// Requested for audio threads, below the priorities normally used for IRQ threads
+constexpr int AUDIO_THREAD_PRIORITY = 40;
+
+struct Error
+{
+    enum Type
+    {
+        LOCK_FAILED, PRIORITY_DENIED
+    } type;
+    int errno_value = 0;
+
+    constexpr auto What() const -> std::string_view
+    {
+        switch (type) {
+        case LOCK_FAILED: return "could not lock memory";
+        case PRIORITY_DENIED: return "real-time priority not allowed";
+        default: return "unknown error";
+        }
+    }
+};
+
+void FlushDenormals();
+auto RaiseThreadPriority() -> tb::error<Error>;
+auto LockMemory(std::span<const std::byte> region) -> tb::error<Error>;
+
+template<typename T>
+auto LockMemory(std::span<T> region) -> tb::error<Error>
+{
+    return LockMemory(std::as_bytes(region));
+}
+
+// Histogram of callback durations. Written by one audio thread and read by the
+// main thread, so counts are relaxed atomics.
+class CallbackStats
+{
+public:
+    static constexpr size_t BUCKET_COUNT = 1000;
+    static constexpr uint64_t NSEC_PER_BUCKET = 10000;
+
+    void Record(std::chrono::nanoseconds duration);
+    void SetRealtimeThread(bool realtime_thread);
+    void Report(std::string_view name) const;
+
+private:
+    auto Percentile(double fraction) const -> std::chrono::microseconds;
+
+    std::array<std::atomic<uint32_t>, BUCKET_COUNT> histogram_ {};
+    std::atomic<uint64_t> calls_ = 0;
+    std::atomic<uint64_t> max_nsec_ = 0;
+    std::atomic<bool> realtime_thread_ = false;    // Got real-time priority
+};
+
+// Times one audio callback. In real-time mode it also prepares the calling
+// thread the first time that thread runs a callback.
+class CallbackScope
+{
+public:
+    CallbackScope(CallbackStats& stats, bool realtime);
+    ~CallbackScope();
+
+    CallbackScope(const CallbackScope&) = delete;
+    auto operator=(const CallbackScope&) -> CallbackScope& = delete;
+
+private:
+    CallbackStats& stats_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+}
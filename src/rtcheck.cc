@@ -0,0 +1,210 @@
+#include "rtcheck.h"
+
+#ifdef WTE_RT_CHECKS
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+
+// glibc's allocator entry points, which the interposed versions forward to
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+}
+
+namespace rtcheck
+{
+
+thread_local const char* current_scope = nullptr;
+thread_local bool reporting = false;
+
+constexpr int MAX_FRAMES = 32;
+
+// Frames identifying a call site. The innermost are the interposer and often
+// operator new, which every allocation shares, so a site is the stack above.
+constexpr int SITE_FRAMES = 8;
+
+// Call sites already reported, so a violation in a callback isn't repeated on
+// every buffer
+constexpr size_t MAX_REPORTED_SITES = 64;
+std::array<std::atomic<uint64_t>, MAX_REPORTED_SITES> reported_sites {};
+
+auto SiteKey(void* const* frames, int frame_count) -> uint64_t
+{
+    // FNV-1a over the return addresses, with 0 kept to mark a free slot
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < std::min(frame_count, SITE_FRAMES); ++i) {
+        hash ^= reinterpret_cast<uintptr_t>(frames[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+auto FirstReport(uint64_t site) -> bool
+{
+    for (std::atomic<uint64_t>& slot : reported_sites) {
+        uint64_t existing = 0;
+        if (slot.compare_exchange_strong(existing, site))
+            return true;
+        if (existing == site)
+            return false;
+    }
+    return false;
+}
+
+// Bypasses stdio and the interposed write, which would report themselves
+void WriteError(std::string_view text)
+{
+    syscall(SYS_write, STDERR_FILENO, text.data(), text.size());
+}
+
+void Violation(const char* call)
+{
+    if (current_scope == nullptr || reporting)
+        return;
+
+    // Set first, as the unwinder can itself allocate on first use
+    reporting = true;
+
+    void* frames[MAX_FRAMES];
+    int frame_count = backtrace(frames, MAX_FRAMES);
+
+    if (FirstReport(SiteKey(frames, frame_count))) {
+        char message[256];
+        int length = snprintf(message, sizeof(message),
+            "Real-time violation: %s called in %s\n", call, current_scope);
+        WriteError({ message, static_cast<size_t>(length) });
+        backtrace_symbols_fd(frames, frame_count, STDERR_FILENO);
+    }
+
+    reporting = false;
+}
+
+RealtimeScope::RealtimeScope(const char* name) : previous_(current_scope)
+{
+    current_scope = name;
+}
+
+RealtimeScope::~RealtimeScope()
+{
+    current_scope = previous_;
+}
+
+// Looked up on first use, as libraries may call these before static
+// initialisation has run
+auto Next(std::atomic<void*>& slot, const char* name) -> void*
+{
+    void* fn = slot.load(std::memory_order_relaxed);
+    if (fn == nullptr) {
+        fn = dlsym(RTLD_NEXT, name);
+        slot.store(fn, std::memory_order_relaxed);
+    }
+    return fn;
+}
+
+}
+
+#define RT_VIOLATION(call) rtcheck::Violation(call)
+
+#define RT_FORWARD(name, ...)                                                 \
+    static std::atomic<void*> next_##name = nullptr;                          \
+    return reinterpret_cast<decltype(&name)>(                                 \
+        rtcheck::Next(next_##name, #name))(__VA_ARGS__)
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+    RT_VIOLATION("malloc");
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    RT_VIOLATION("calloc");
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    RT_VIOLATION("realloc");
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+    if (ptr != nullptr)
+        RT_VIOLATION("free");
+    __libc_free(ptr);
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+    RT_VIOLATION("pthread_mutex_lock");
+    RT_FORWARD(pthread_mutex_lock, mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+    RT_VIOLATION("pthread_cond_wait");
+    RT_FORWARD(pthread_cond_wait, cond, mutex);
+}
+
+int sem_wait(sem_t* sem)
+{
+    RT_VIOLATION("sem_wait");
+    RT_FORWARD(sem_wait, sem);
+}
+
+ssize_t read(int fd, void* buffer, size_t count)
+{
+    RT_VIOLATION("read");
+    RT_FORWARD(read, fd, buffer, count);
+}
+
+ssize_t write(int fd, const void* buffer, size_t count)
+{
+    RT_VIOLATION("write");
+    RT_FORWARD(write, fd, buffer, count);
+}
+
+size_t fwrite(const void* buffer, size_t size, size_t count, FILE* file)
+{
+    RT_VIOLATION("fwrite");
+    RT_FORWARD(fwrite, buffer, size, count, file);
+}
+
+FILE* fopen(const char* path, const char* mode)
+{
+    RT_VIOLATION("fopen");
+    RT_FORWARD(fopen, path, mode);
+}
+
+int nanosleep(const timespec* duration, timespec* remaining)
+{
+    RT_VIOLATION("nanosleep");
+    RT_FORWARD(nanosleep, duration, remaining);
+}
+
+int usleep(useconds_t usec)
+{
+    RT_VIOLATION("usleep");
+    RT_FORWARD(usleep, usec);
+}
+
+}
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+// Debug instrumentation for real-time code. When built with WTE_RT_CHECKS,
+// allocations, mutex locks and blocking I/O made while a RealtimeScope is
+// active on the calling thread are reported to stderr with a backtrace, once
+// per call stack. Otherwise scopes compile away.
+namespace rtcheck
+{
+
+#ifdef WTE_RT_CHECKS
+
+class RealtimeScope
+{
+public:
+    RealtimeScope(const char* name);
+    ~RealtimeScope();
+
+    RealtimeScope(const RealtimeScope&) = delete;
+    auto operator=(const RealtimeScope&) -> RealtimeScope& = delete;
+
+private:
+    const char* previous_;
+};
+
+#else
+
+class RealtimeScope
+{
+public:
+    RealtimeScope(const char*) {}
+};
+
+#endif
+
+}
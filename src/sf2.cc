@@ -0,0 +1,574 @@
+#include "sf2.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <optional>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+enum GeneratorType : uint16_t
+{
+    START_ADDRS_OFFSET = 0, END_ADDRS_OFFSET = 1, START_LOOP_ADDRS_OFFSET = 2,
+    END_LOOP_ADDRS_OFFSET = 3, START_ADDRS_COARSE_OFFSET = 4,
+    END_ADDRS_COARSE_OFFSET = 12, DELAY_VOL_ENV = 33, ATTACK_VOL_ENV = 34,
+    HOLD_VOL_ENV = 35, DECAY_VOL_ENV = 36, SUSTAIN_VOL_ENV = 37,
+    RELEASE_VOL_ENV = 38, INSTRUMENT = 41, KEY_RANGE = 43, VELOCITY_RANGE = 44,
+    START_LOOP_ADDRS_COARSE_OFFSET = 45, INITIAL_ATTENUATION = 48,
+    END_LOOP_ADDRS_COARSE_OFFSET = 50, COARSE_TUNE = 51, FINE_TUNE = 52,
+    SAMPLE_ID = 53, SAMPLE_MODES = 54, SCALE_TUNING = 56,
+    OVERRIDING_ROOT_KEY = 58, GENERATOR_COUNT = 61
+};
+
+using GeneratorValues = std::array<int32_t, GENERATOR_COUNT>;
+
+constexpr auto DEFAULT_GENERATOR_VALUES = [] {
+    GeneratorValues values {};
+    values[DELAY_VOL_ENV] = values[ATTACK_VOL_ENV] = values[HOLD_VOL_ENV]
+        = values[DECAY_VOL_ENV] = values[RELEASE_VOL_ENV] = -12000;
+    values[KEY_RANGE] = values[VELOCITY_RANGE] = 0x7F00;
+    values[SCALE_TUNING] = 100;
+    values[OVERRIDING_ROOT_KEY] = -1;
+    return values;
+}();
+
+// Generators which a preset zone may offset, per SoundFont 2.01 section 8.5
+constexpr auto IsAdditiveGenerator(uint16_t op) -> bool
+{
+    switch (op) {
+    case START_ADDRS_OFFSET: case END_ADDRS_OFFSET: case START_LOOP_ADDRS_OFFSET:
+    case END_LOOP_ADDRS_OFFSET: case START_ADDRS_COARSE_OFFSET:
+    case END_ADDRS_COARSE_OFFSET: case START_LOOP_ADDRS_COARSE_OFFSET:
+    case END_LOOP_ADDRS_COARSE_OFFSET: case INSTRUMENT: case KEY_RANGE:
+    case VELOCITY_RANGE: case SAMPLE_ID: case SAMPLE_MODES:
+    case OVERRIDING_ROOT_KEY:
+        return false;
+    default:
+        return op < GENERATOR_COUNT;
+    }
+}
+
+template<typename T>
+auto ReadLE(const uint8_t* data) -> T
+{
+    T result;
+    memcpy(&result, data, sizeof(T));
+    if constexpr (std::endian::native == std::endian::big)
+        return tb::reverse_endian(result);
+    else
+        return result;
+}
+
+// Finds the sub-chunk with the given ID in a run of RIFF chunks
+auto FindChunk(std::span<const uint8_t> data, std::string_view id)
+-> std::optional<std::span<const uint8_t>>
+{
+    while (data.size() >= 8) {
+        auto size = ReadLE<uint32_t>(data.data() + 4);
+        if (size > data.size() - 8)
+            return std::nullopt;
+
+        if (memcmp(data.data(), id.data(), 4) == 0)
+            return data.subspan(8, size);
+
+        data = data.subspan(std::min<size_t>(data.size(), 8 + size + (size & 1)));
+    }
+
+    return std::nullopt;
+}
+
+// Finds the LIST chunk of the given type, returning its contents after the type
+auto FindList(std::span<const uint8_t> data, std::string_view type)
+-> std::optional<std::span<const uint8_t>>
+{
+    while (data.size() >= 12) {
+        auto list = FindChunk(data, "LIST");
+        if (!list) return std::nullopt;
+
+        if (list->size() >= 4 && memcmp(list->data(), type.data(), 4) == 0)
+            return list->subspan(4);
+
+        data = data.subspan(list->data() + list->size() - data.data());
+        if (!data.empty() && (list->size() & 1))
+            data = data.subspan(1);
+    }
+
+    return std::nullopt;
+}
+
+template<size_t RECORD_SIZE, typename T, typename ReadFn>
+auto ReadRecords(std::span<const uint8_t> pdta, std::string_view id,
+    std::vector<T>& output, ReadFn read) -> tb::error<sf2::Error>
+{
+    auto chunk = FindChunk(pdta, id);
+    if (!chunk)
+        return sf2::Error { sf2::Error::MISSING_CHUNK };
+
+    // Each list ends with a terminal record, so there must be at least one
+    if (chunk->size() % RECORD_SIZE != 0 || chunk->size() < RECORD_SIZE)
+        return sf2::Error { sf2::Error::BAD_CHUNK };
+
+    output.reserve(chunk->size() / RECORD_SIZE);
+    for (size_t i = 0; i < chunk->size(); i += RECORD_SIZE)
+        output.push_back(read(chunk->data() + i));
+
+    return tb::ok;
+}
+
+auto TimecentsToSeconds(int32_t timecents) -> float
+{
+    return exp2f(timecents / 1200.f);
+}
+
+auto CentibelsToGain(int32_t centibels) -> float
+{
+    return powf(10.f, std::clamp(centibels, 0, 1440) / -200.f);
+}
+
+void PrefetchRange(std::span<const int16_t> samples)
+{
+    if (samples.empty()) return;
+
+    static const long page_size = sysconf(_SC_PAGESIZE);
+    auto address = reinterpret_cast<uintptr_t>(samples.data());
+    uintptr_t aligned = address & ~static_cast<uintptr_t>(page_size - 1);
+
+    madvise(reinterpret_cast<void*>(aligned),
+        samples.size_bytes() + (address - aligned), MADV_WILLNEED);
+}
+
+}
+
+namespace sf2
+{
+
+auto Instrument::ZonesForNote(uint8_t note) const -> std::span<const uint16_t>
+{
+    if (note > midi::MAX_NOTE) return {};
+
+    auto [first, count] = note_table[note];
+    return { zone_indices.data() + first, count };
+}
+
+SoundFont::SoundFont(SoundFont&& other)
+{
+    *this = std::move(other);
+}
+
+SoundFont& SoundFont::operator=(SoundFont&& other)
+{
+    std::swap(mapping_, other.mapping_);
+    std::swap(mapping_size_, other.mapping_size_);
+    std::swap(samples_, other.samples_);
+    std::swap(presets_, other.presets_);
+    std::swap(preset_bags_, other.preset_bags_);
+    std::swap(instrument_bags_, other.instrument_bags_);
+    std::swap(preset_generators_, other.preset_generators_);
+    std::swap(instrument_generators_, other.instrument_generators_);
+    std::swap(instruments_, other.instruments_);
+    std::swap(sample_headers_, other.sample_headers_);
+    return *this;
+}
+
+SoundFont::~SoundFont()
+{
+    if (mapping_)
+        munmap(mapping_, mapping_size_);
+}
+
+auto SoundFont::FromFile(std::string_view path) -> tb::result<SoundFont, Error>
+{
+    int fd = open(path.data(), O_RDONLY);
+    if (fd == -1)
+        return Error { Error::FILE_NOT_FOUND };
+
+    tb::scoped_guard close_file = [fd] { close(fd); };
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size < 12)
+        return Error { Error::NOT_A_SOUNDFONT };
+
+    // Sample data is never copied: pages are only faulted in for the samples
+    // that are actually played
+    SoundFont soundfont;
+    soundfont.mapping_size_ = file_stat.st_size;
+    soundfont.mapping_ = mmap(nullptr, soundfont.mapping_size_, PROT_READ,
+        MAP_PRIVATE, fd, 0);
+
+    if (soundfont.mapping_ == MAP_FAILED) {
+        soundfont.mapping_ = nullptr;
+        return Error { Error::MAPPING_ERROR };
+    }
+
+    std::span<const uint8_t> file {
+        static_cast<const uint8_t*>(soundfont.mapping_), soundfont.mapping_size_
+    };
+
+    auto riff = FindChunk(file, "RIFF");
+    if (!riff || riff->size() < 4 || memcmp(riff->data(), "sfbk", 4) != 0)
+        return Error { Error::NOT_A_SOUNDFONT };
+
+    std::span<const uint8_t> body = riff->subspan(4);
+
+    auto sdta = FindList(body, "sdta");
+    auto pdta = FindList(body, "pdta");
+    if (!sdta || !pdta)
+        return Error { Error::MISSING_CHUNK };
+
+    auto smpl = FindChunk(*sdta, "smpl");
+    if (!smpl)
+        return Error { Error::MISSING_CHUNK };
+
+    if (reinterpret_cast<uintptr_t>(smpl->data()) % alignof(int16_t) != 0)
+        return Error { Error::BAD_CHUNK };
+
+    soundfont.samples_ = {
+        reinterpret_cast<const int16_t*>(smpl->data()),
+        smpl->size() / sizeof(int16_t)
+    };
+
+    // Zones are scattered across the sample data, so readahead only wastes
+    // memory on samples that may never be used
+    madvise(soundfont.mapping_, soundfont.mapping_size_, MADV_RANDOM);
+
+    if (auto result = soundfont.ParsePresetData(*pdta); result.is_error())
+        return result.get_error();
+
+    return soundfont;
+}
+
+auto SoundFont::ParsePresetData(std::span<const uint8_t> pdta) -> tb::error<Error>
+{
+    auto read_preset = [] (const uint8_t* data) {
+        return PresetHeader {
+            .name = std::string(reinterpret_cast<const char*>(data),
+                strnlen(reinterpret_cast<const char*>(data), 20)),
+            .program = ReadLE<uint16_t>(data + 20),
+            .bank = ReadLE<uint16_t>(data + 22),
+            .bag_index = ReadLE<uint16_t>(data + 24)
+        };
+    };
+
+    auto read_bag = [] (const uint8_t* data) {
+        return Bag { .generator_index = ReadLE<uint16_t>(data) };
+    };
+
+    auto read_generator = [] (const uint8_t* data) {
+        return GeneratorEntry {
+            .op = ReadLE<uint16_t>(data),
+            .amount = ReadLE<int16_t>(data + 2)
+        };
+    };
+
+    auto read_instrument = [] (const uint8_t* data) {
+        return InstrumentHeader { .bag_index = ReadLE<uint16_t>(data + 20) };
+    };
+
+    auto read_sample = [] (const uint8_t* data) {
+        return SampleHeader {
+            .start = ReadLE<uint32_t>(data + 20),
+            .end = ReadLE<uint32_t>(data + 24),
+            .loop_start = ReadLE<uint32_t>(data + 28),
+            .loop_end = ReadLE<uint32_t>(data + 32),
+            .sample_rate = ReadLE<uint32_t>(data + 36),
+            .original_pitch = data[40],
+            .pitch_correction = static_cast<int8_t>(data[41])
+        };
+    };
+
+    tb::error<Error> results[] = {
+        ReadRecords<38>(pdta, "phdr", presets_, read_preset),
+        ReadRecords<4>(pdta, "pbag", preset_bags_, read_bag),
+        ReadRecords<4>(pdta, "pgen", preset_generators_, read_generator),
+        ReadRecords<22>(pdta, "inst", instruments_, read_instrument),
+        ReadRecords<4>(pdta, "ibag", instrument_bags_, read_bag),
+        ReadRecords<4>(pdta, "igen", instrument_generators_, read_generator),
+        ReadRecords<46>(pdta, "shdr", sample_headers_, read_sample)
+    };
+
+    for (auto& result : results) {
+        if (result.is_error())
+            return result.get_error();
+    }
+
+    return tb::ok;
+}
+
+auto SoundFont::GetPresets() const -> const std::vector<PresetHeader>&
+{
+    return presets_;
+}
+
+auto SoundFont::GetInstrument(uint16_t bank, uint16_t program) const
+-> tb::result<Instrument, Error>
+{
+    // The last record of every list is a terminator, not a real entry
+    auto preset = std::find_if(presets_.begin(), presets_.end() - 1,
+        [&] (const PresetHeader& p) { return p.bank == bank && p.program == program; });
+
+    if (preset == presets_.end() - 1)
+        return Error { Error::PRESET_NOT_FOUND };
+
+    Instrument result { .name = preset->name, .samples = samples_ };
+
+    // Returns the generator range of a bag, or nullopt if it is out of bounds
+    auto generator_range = [] (const std::vector<Bag>& bags, size_t bag,
+        const std::vector<GeneratorEntry>& generators)
+    -> std::optional<std::span<const GeneratorEntry>> {
+        if (bag + 1 >= bags.size()) return std::nullopt;
+
+        size_t first = bags[bag].generator_index, last = bags[bag + 1].generator_index;
+        if (first > last || last > generators.size()) return std::nullopt;
+
+        return std::span { generators.data() + first, last - first };
+    };
+
+    auto intersect_range = [] (int32_t a, int32_t b) -> int32_t {
+        int32_t low = std::max(a & 0xFF, b & 0xFF);
+        int32_t high = std::min((a >> 8) & 0xFF, (b >> 8) & 0xFF);
+        return low | (high << 8);
+    };
+
+    GeneratorValues preset_global {};
+    preset_global[KEY_RANGE] = preset_global[VELOCITY_RANGE] = 0x7F00;
+
+    size_t preset_bag_end = (preset + 1)->bag_index;
+    for (size_t pbag = preset->bag_index; pbag < preset_bag_end; ++pbag) {
+        auto preset_gens = generator_range(preset_bags_, pbag, preset_generators_);
+        if (!preset_gens) return Error { Error::BAD_CHUNK };
+
+        GeneratorValues preset_values = preset_global;
+        std::optional<uint16_t> instrument_index;
+        for (const GeneratorEntry& gen : *preset_gens) {
+            if (gen.op == INSTRUMENT)
+                instrument_index = gen.amount;
+            else if (gen.op < GENERATOR_COUNT)
+                preset_values[gen.op] = gen.amount;
+        }
+
+        // A first zone without an instrument is the global zone
+        if (!instrument_index) {
+            if (pbag == preset->bag_index)
+                preset_global = preset_values;
+            continue;
+        }
+
+        if (size_t { *instrument_index } + 1 >= instruments_.size())
+            return Error { Error::BAD_CHUNK };
+
+        const InstrumentHeader& inst = instruments_[*instrument_index];
+        size_t inst_bag_end = instruments_[*instrument_index + 1].bag_index;
+        GeneratorValues inst_global = DEFAULT_GENERATOR_VALUES;
+
+        for (size_t ibag = inst.bag_index; ibag < inst_bag_end; ++ibag) {
+            auto inst_gens = generator_range(instrument_bags_, ibag,
+                instrument_generators_);
+            if (!inst_gens) return Error { Error::BAD_CHUNK };
+
+            GeneratorValues values = inst_global;
+            std::optional<uint16_t> sample_index;
+            for (const GeneratorEntry& gen : *inst_gens) {
+                if (gen.op == SAMPLE_ID)
+                    sample_index = gen.amount;
+                else if (gen.op < GENERATOR_COUNT)
+                    values[gen.op] = gen.amount;
+            }
+
+            if (!sample_index) {
+                if (ibag == inst.bag_index)
+                    inst_global = values;
+                continue;
+            }
+
+            if (size_t { *sample_index } + 1 >= sample_headers_.size())
+                return Error { Error::BAD_CHUNK };
+
+            for (uint16_t op = 0; op < GENERATOR_COUNT; ++op) {
+                if (IsAdditiveGenerator(op))
+                    values[op] += preset_values[op];
+            }
+
+            values[KEY_RANGE] = intersect_range(values[KEY_RANGE],
+                preset_values[KEY_RANGE]);
+            values[VELOCITY_RANGE] = intersect_range(values[VELOCITY_RANGE],
+                preset_values[VELOCITY_RANGE]);
+
+            const SampleHeader& sample = sample_headers_[*sample_index];
+            auto offset = [&values] (GeneratorType fine, GeneratorType coarse) {
+                return static_cast<int64_t>(values[fine]) + values[coarse] * 32768;
+            };
+
+            int64_t start = sample.start + offset(START_ADDRS_OFFSET,
+                START_ADDRS_COARSE_OFFSET);
+            int64_t end = sample.end + offset(END_ADDRS_OFFSET,
+                END_ADDRS_COARSE_OFFSET);
+            int64_t loop_start = sample.loop_start + offset(START_LOOP_ADDRS_OFFSET,
+                START_LOOP_ADDRS_COARSE_OFFSET);
+            int64_t loop_end = sample.loop_end + offset(END_LOOP_ADDRS_OFFSET,
+                END_LOOP_ADDRS_COARSE_OFFSET);
+
+            // Interpolation reads one frame ahead of the play position
+            if (start < 0 || end <= start + 1
+                || end > static_cast<int64_t>(samples_.size()))
+                continue;
+
+            bool loop = (values[SAMPLE_MODES] & 1) && loop_start >= start
+                && loop_end > loop_start + 1 && loop_end <= end;
+
+            uint8_t root_key = values[OVERRIDING_ROOT_KEY] >= 0
+                ? values[OVERRIDING_ROOT_KEY]
+                : sample.original_pitch <= midi::MAX_NOTE ? sample.original_pitch : 60;
+
+            result.zones.push_back(Zone {
+                .start = static_cast<uint32_t>(start),
+                .end = static_cast<uint32_t>(end),
+                .loop_start = static_cast<uint32_t>(loop ? loop_start : start),
+                .loop_end = static_cast<uint32_t>(loop ? loop_end : end),
+                .sample_rate = sample.sample_rate,
+                .key_low = static_cast<uint8_t>(values[KEY_RANGE] & 0xFF),
+                .key_high = static_cast<uint8_t>((values[KEY_RANGE] >> 8) & 0xFF),
+                .velocity_low = static_cast<uint8_t>(values[VELOCITY_RANGE] & 0xFF),
+                .velocity_high
+                    = static_cast<uint8_t>((values[VELOCITY_RANGE] >> 8) & 0xFF),
+                .root_key = root_key,
+                .loop = loop,
+                .tune_cents = values[COARSE_TUNE] * 100.f + values[FINE_TUNE]
+                            + sample.pitch_correction,
+                .scale_tuning = static_cast<float>(values[SCALE_TUNING]),
+                .gain = CentibelsToGain(values[INITIAL_ATTENUATION]),
+                .envelope = {
+                    .delay = TimecentsToSeconds(values[DELAY_VOL_ENV]),
+                    .attack = TimecentsToSeconds(values[ATTACK_VOL_ENV]),
+                    .hold = TimecentsToSeconds(values[HOLD_VOL_ENV]),
+                    .decay = TimecentsToSeconds(values[DECAY_VOL_ENV]),
+                    .sustain = CentibelsToGain(values[SUSTAIN_VOL_ENV]),
+                    .release = TimecentsToSeconds(values[RELEASE_VOL_ENV])
+                }
+            });
+            result.release = std::max(result.release, result.zones.back().envelope.release);
+        }
+    }
+
+    if (result.zones.size() > std::numeric_limits<uint16_t>::max())
+        return Error { Error::BAD_CHUNK };
+
+    for (uint8_t note = 0; note <= midi::MAX_NOTE; ++note) {
+        auto first = static_cast<uint32_t>(result.zone_indices.size());
+        for (size_t i = 0; i < result.zones.size(); ++i) {
+            const Zone& zone = result.zones[i];
+            if (note >= zone.key_low && note <= zone.key_high)
+                result.zone_indices.push_back(i);
+        }
+        result.note_table[note] = {
+            first, static_cast<uint16_t>(result.zone_indices.size() - first)
+        };
+    }
+
+    for (const Zone& zone : result.zones)
+        PrefetchRange(samples_.subspan(zone.start, zone.end - zone.start));
+
+    return result;
+}
+
+auto LockInstrumentMemory(const Instrument& instrument) -> tb::error<realtime::Error>
+{
+    if (auto result = realtime::LockMemory(std::span(instrument.zones)); result.is_error())
+        return result;
+    if (auto result = realtime::LockMemory(std::span(instrument.zone_indices));
+        result.is_error())
+        return result;
+
+    for (const Zone& zone : instrument.zones) {
+        auto samples = instrument.samples.subspan(zone.start, zone.end - zone.start);
+        if (auto result = realtime::LockMemory(samples); result.is_error())
+            return result;
+    }
+
+    return tb::ok;
+}
+
+// At a time since the voice's note on, through its release once the note is off
+auto EnvelopeLevel(const Envelope& envelope, const Voice& voice, double seconds) -> float
+{
+    if (voice.seconds_since_off < 0)
+        return envelope.Level(seconds);
+
+    double seconds_since_off = voice.seconds_since_off + (seconds - voice.seconds_since_on);
+    return envelope.ReleasedLevel(seconds, seconds_since_off);
+}
+
+void RenderSampler(const Synth& synth, Generator& generator,
+    std::span<const Voice> voices, std::span<Sample> dest)
+{
+    constexpr size_t ENVELOPE_STEP = 16;
+    constexpr float SAMPLE_SCALE = 1.f / 32768;
+
+    const Instrument& instrument = *synth.instrument;
+    const int16_t* samples = instrument.samples.data();
+    double seconds_per_sample = 1.0 / generator.sample_rate;
+
+    for (const Voice& voice : voices) {
+        // Rounded, as truncating the round trip from the MIDI velocity can land
+        // one below it and pick the wrong layer
+        auto velocity = static_cast<uint8_t>(
+            std::lround(voice.velocity * midi::MAX_VELOCITY));
+
+        for (uint16_t zone_index : instrument.ZonesForNote(voice.note)) {
+            const Zone& zone = instrument.zones[zone_index];
+            if (velocity < zone.velocity_low || velocity > zone.velocity_high)
+                continue;
+
+            double pitch_ratio = exp2(
+                ((voice.note - zone.root_key) * zone.scale_tuning + zone.tune_cents)
+                / 1200.0
+            );
+            double step = pitch_ratio * zone.sample_rate * seconds_per_sample;
+            double position = zone.start
+                + voice.seconds_since_on * zone.sample_rate * pitch_ratio;
+            double loop_length = zone.loop_end - zone.loop_start;
+
+            if (zone.loop && position >= zone.loop_end)
+                position = zone.loop_start + fmod(position - zone.loop_start, loop_length);
+
+            float gain = VOICE_VOLUME * voice.velocity * zone.gain * SAMPLE_SCALE;
+            float level = 0, level_step = 0;
+
+            for (size_t i = 0; i < dest.size(); ++i) {
+                if (!zone.loop && position >= zone.end - 1)
+                    break;
+
+                // Evaluate the envelope sparsely and interpolate in between
+                if (i % ENVELOPE_STEP == 0) {
+                    double time = voice.seconds_since_on + i * seconds_per_sample;
+                    level = EnvelopeLevel(zone.envelope, voice, time);
+                    float target = EnvelopeLevel(zone.envelope, voice,
+                        time + ENVELOPE_STEP * seconds_per_sample);
+                    level_step = (target - level) / ENVELOPE_STEP;
+                }
+
+                auto index = static_cast<uint32_t>(position);
+                float fraction = position - index;
+                uint32_t next = index + 1;
+                if (zone.loop && next >= zone.loop_end)
+                    next = zone.loop_start;
+
+                float a = samples[index], b = samples[next];
+                dest[i] += (a + (b - a) * fraction) * gain * level;
+
+                level += level_step;
+                position += step;
+                if (zone.loop && position >= zone.loop_end)
+                    position -= loop_length;
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sound.h"
+
+#include <tb/tb.h>
+
+namespace sf2
+{
+
+struct Error
+{
+    enum ErrorType
+    {
+        FILE_NOT_FOUND, MAPPING_ERROR, NOT_A_SOUNDFONT, MISSING_CHUNK, BAD_CHUNK,
+        PRESET_NOT_FOUND
+    };
+
+    ErrorType type;
+
+    constexpr auto What() const -> std::string_view
+    {
+        switch (type) {
+        case FILE_NOT_FOUND: return "file not found";
+        case MAPPING_ERROR: return "could not map file";
+        case NOT_A_SOUNDFONT: return "not a soundfont";
+        case MISSING_CHUNK: return "missing chunk";
+        case BAD_CHUNK: return "bad chunk";
+        case PRESET_NOT_FOUND: return "preset not found";
+        default: return "unknown error";
+        }
+    }
+};
+
+// A sample region resolved from a preset and instrument zone pair, with all
+// generators already applied
+struct Zone
+{
+    uint32_t start, end, loop_start, loop_end; // Frames into the sample data
+    uint32_t sample_rate;
+    uint8_t key_low, key_high, velocity_low, velocity_high;
+    uint8_t root_key;
+    bool loop;
+    float tune_cents;      // Coarse, fine and sample pitch correction
+    float scale_tuning;    // Cents per key
+    float gain;            // Initial attenuation as a linear gain
+    Envelope envelope;
+};
+
+struct Instrument
+{
+    std::string name;
+    std::vector<Zone> zones;
+    // Indices into zones for every key, addressed through note_table
+    std::vector<uint16_t> zone_indices;
+    std::array<std::pair<uint32_t, uint16_t>, midi::MAX_NOTE + 1> note_table {};
+    std::span<const int16_t> samples;
+    float release = 0;      // The longest of the zones' releases
+
+    auto ZonesForNote(uint8_t note) const -> std::span<const uint16_t>;
+};
+
+struct PresetHeader
+{
+    std::string name;
+    uint16_t program, bank, bag_index;
+};
+
+struct Bag
+{
+    uint16_t generator_index;
+};
+
+struct GeneratorEntry
+{
+    uint16_t op;
+    int16_t amount;
+};
+
+struct InstrumentHeader
+{
+    uint16_t bag_index;
+};
+
+struct SampleHeader
+{
+    uint32_t start, end, loop_start, loop_end, sample_rate;
+    uint8_t original_pitch;
+    int8_t pitch_correction;
+};
+
+class SoundFont
+{
+public:
+    SoundFont() = default;
+    SoundFont(const SoundFont&) = delete;
+    SoundFont& operator=(const SoundFont&) = delete;
+    SoundFont(SoundFont&& other);
+    SoundFont& operator=(SoundFont&& other);
+    ~SoundFont();
+
+    static auto FromFile(std::string_view path) -> tb::result<SoundFont, Error>;
+
+    auto GetInstrument(uint16_t bank, uint16_t program) const
+    -> tb::result<Instrument, Error>;
+    auto GetPresets() const -> const std::vector<PresetHeader>&;
+
+private:
+    auto ParsePresetData(std::span<const uint8_t> pdta) -> tb::error<Error>;
+
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    std::span<const int16_t> samples_;
+
+    std::vector<PresetHeader> presets_;
+    std::vector<Bag> preset_bags_, instrument_bags_;
+    std::vector<GeneratorEntry> preset_generators_, instrument_generators_;
+    std::vector<InstrumentHeader> instruments_;
+    std::vector<SampleHeader> sample_headers_;
+};
+
+// Locks the sample ranges an instrument's zones play, along with its lookup
+// tables, so the sampler never faults them in from the file mid-callback
+auto LockInstrumentMemory(const Instrument& instrument) -> tb::error<realtime::Error>;
+
+void RenderSampler(const Synth& synth, Generator& generator,
+                   std::span<const Voice> voices, std::span<Sample> dest);
+
+}
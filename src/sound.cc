@@ -1,6 +1,8 @@
 #include "sound.h"
 
 #include "events.h"
+#include "rtcheck.h"
+#include "sf2.h"
 
 #include <algorithm>
 
@@ -19,6 +21,55 @@ constexpr auto NOTE_TO_FREQUENCY_TABLE = [] () -> std::array<float, 128> {
     return result;
 }();
 
+constexpr size_t SINE_TABLE_SIZE = 2048;
+
+// One extra entry so interpolation never has to wrap
+const auto SINE_TABLE = [] {
+    std::array<float, SINE_TABLE_SIZE + 1> result;
+    for (size_t i = 0; i <= SINE_TABLE_SIZE; ++i)
+        result[i] = sinf(2 * M_PI * i / SINE_TABLE_SIZE);
+    return result;
+}();
+
+// Phase in cycles
+auto TableSine(FloatLanes phase) -> FloatLanes
+{
+    FloatLanes result;
+    for (size_t lane = 0; lane < SIMD_LANES; ++lane) {
+        float position = (phase[lane] - floorf(phase[lane])) * SINE_TABLE_SIZE;
+        // Rounding can land a phase just below zero exactly on 1
+        auto index = std::min(static_cast<size_t>(position), SINE_TABLE_SIZE - 1);
+        float a = SINE_TABLE[index], b = SINE_TABLE[index + 1];
+        result[lane] = a + (b - a) * (position - index);
+    }
+    return result;
+}
+
+auto Envelope::Level(double seconds) const -> float
+{
+    if (seconds < delay) return 0;
+    seconds -= delay;
+
+    if (seconds < attack) return seconds / attack;
+    seconds -= attack;
+
+    if (seconds < hold) return 1;
+    seconds -= hold;
+
+    if (decay <= 0) return sustain;
+
+    float level = powf(10.f, (-100.f * seconds / decay) / 20.f);
+    return std::max(level, sustain);
+}
+
+auto Envelope::ReleasedLevel(double seconds, double seconds_since_off) const -> float
+{
+    if (seconds_since_off >= release) return 0;
+
+    float level = Level(seconds - seconds_since_off);
+    return level * powf(10.f, (-100.f * seconds_since_off / release) / 20.f);
+}
+
 auto Generator::GenerateSamples(std::span<Sample> samples, size_t count,
     const midi::Player& midi_status, unsigned sample_offset, const Synth& synth)
     -> size_t
@@ -26,44 +77,386 @@ auto Generator::GenerateSamples(std::span<Sample> samples, size_t count,
     if (count > samples.size())
         count = samples.size();
 
-    midi::Ticks current_time = midi_status.GetTicksElapsed();
+    double current_time = midi_status.GetSecondsElapsed()
+                        + static_cast<double>(sample_offset) / sample_rate;
 
-    float volume = 0.3f;
-    float decay_constant = synth.decay_constant;
-    float decay_common_ratio = powf(2, (-1.f / sample_rate) * decay_constant);
-
-    unsigned start_point = sample_point;
+    std::array<Voice, midi::MAX_NOTE + 1> voices;
+    size_t voice_count = 0;
 
     for (uint8_t note = 0; note <= midi::MAX_NOTE; ++note) {
         const midi::NoteInfo& info = midi_status.GetCurrentNotes()[note];
-        if (!info.note_on) continue;
-
-        sample_point = start_point;
-        float initial_ticks_diff
-            = current_time - info.time
-            + (sample_offset * midi_status.GetTicksPerSecond() / sample_rate);
-        float decay = std::clamp(
-            powf(2, initial_ticks_diff * decay_constant
-                    / (-1.f * midi_status.GetTicksPerSecond())),
-            -1.f, 1.f
-        );
+        bool releasing = info.released && current_time - info.seconds_off < synth.release;
+        if (!info.note_on && !releasing) continue;
 
         uint8_t transposed_note
             = std::clamp<uint8_t>(note + midi_status.transposition_offset_, 0, 127);
-        float freq = NOTE_TO_FREQUENCY_TABLE[transposed_note];
 
-        for (size_t i = 0; i < count; ++i) {
+        voices[voice_count++] = {
+            .note = transposed_note,
+            .velocity = info.velocity / midi::MAX_VELOCITY,
+            .freq = NOTE_TO_FREQUENCY_TABLE[transposed_note],
+            .seconds_since_on = current_time - info.seconds,
+            .seconds_since_off = info.note_on ? -1 : current_time - info.seconds_off,
+            .onset = info.time
+        };
+    }
+
+    synth.render_fn(synth, *this, { voices.data(), voice_count },
+        samples.first(count));
+
+    sample_point += count;
+
+    return count;
+}
+
+void RenderWaveform(const Synth& synth, Generator& generator,
+    std::span<const Voice> voices, std::span<Sample> dest)
+{
+    float decay_constant = synth.decay_constant;
+    float decay_common_ratio
+        = powf(2, (-1.f / generator.sample_rate) * decay_constant);
+
+    for (const Voice& voice : voices) {
+        unsigned sample_point = generator.sample_point;
+        float decay = std::clamp(
+            powf(2, voice.seconds_since_on * -decay_constant), -1.f, 1.f
+        );
+
+        for (Sample& sample : dest) {
             ++sample_point;
             decay *= decay_common_ratio;
 
-            samples[i] += synth.wave_fn(freq, sample_point, sample_rate)
-                        * volume
-                        * (info.velocity / midi::MAX_VELOCITY)
-                        * decay;
+            sample += synth.wave_fn(voice.freq, sample_point, generator.sample_rate)
+                    * VOICE_VOLUME
+                    * voice.velocity
+                    * decay;
         }
     }
+}
+
+void StringBank::Allocate(int sample_rate)
+{
+    std::array<size_t, midi::MAX_NOTE + 1> lengths;
+    size_t total = 0;
+
+    for (uint8_t note = 0; note <= midi::MAX_NOTE; ++note) {
+        lengths[note] = static_cast<size_t>(sample_rate / NOTE_TO_FREQUENCY_TABLE[note]) + 2;
+        total += lengths[note];
+    }
 
-    return count;
+    pool.assign(total, 0.f);
+
+    size_t offset = 0;
+    for (uint8_t note = 0; note <= midi::MAX_NOTE; ++note) {
+        voices[note] = { .delay_line = { pool.data() + offset, lengths[note] } };
+        offset += lengths[note];
+    }
+}
+
+void ExciteString(StringBank& bank, StringVoice& string, const Voice& voice,
+    int sample_rate, float decay_constant)
+{
+    // The averaging filter delays by half a sample, and the allpass makes up the
+    // remaining fraction, kept within [0.1, 1.1) where its delay is flattest
+    double delay = sample_rate / voice.freq;
+    size_t length = std::clamp<size_t>(delay - 0.6, 2, string.delay_line.size());
+    float fraction = std::max(delay - 0.5 - length, 0.1);
+
+    string.length = length;
+    string.position = 0;
+    string.last_output = 0;
+    string.allpass_coefficient = (1 - fraction) / (1 + fraction);
+    string.allpass_input = string.allpass_output = 0;
+    string.loss = powf(2, -decay_constant / voice.freq);
+    string.onset = voice.onset;
+    string.active = true;
+
+    // Harder strikes excite more high harmonics
+    float brightness = 0.2f + 0.8f * voice.velocity;
+    float filtered = 0, mean = 0;
+    std::span<float> line = string.delay_line.first(length);
+
+    for (float& x : line) {
+        bank.noise_state ^= bank.noise_state << 13;
+        bank.noise_state ^= bank.noise_state >> 17;
+        bank.noise_state ^= bank.noise_state << 5;
+        float noise = static_cast<float>(bank.noise_state) / UINT32_MAX * 2.f - 1.f;
+
+        filtered += brightness * (noise - filtered);
+        x = filtered * voice.velocity;
+        mean += x;
+    }
+
+    mean /= length;
+    for (float& x : line)
+        x -= mean;
+}
+
+void RenderString(const Synth& synth, Generator& generator,
+    std::span<const Voice> voices, std::span<Sample> dest)
+{
+    StringBank& bank = generator.strings;
+    if (bank.pool.empty()) return;
+
+    std::array<bool, midi::MAX_NOTE + 1> sounding {};
+
+    for (const Voice& voice : voices) {
+        StringVoice& string = bank.voices[voice.note];
+        sounding[voice.note] = true;
+
+        if (!string.active || string.onset != voice.onset)
+            ExciteString(bank, string, voice, generator.sample_rate,
+                synth.decay_constant);
+
+        float* line = string.delay_line.data();
+        const float coefficient = string.allpass_coefficient;
+
+        for (Sample& sample : dest) {
+            float output = line[string.position];
+            float averaged = 0.5f * (output + string.last_output) * string.loss;
+            string.last_output = output;
+
+            float allpass = coefficient * (averaged - string.allpass_output)
+                          + string.allpass_input;
+            string.allpass_input = averaged;
+            string.allpass_output = allpass;
+
+            line[string.position] = allpass;
+            if (++string.position == string.length)
+                string.position = 0;
+
+            sample += output * VOICE_VOLUME;
+        }
+    }
+
+    for (uint8_t note = 0; note <= midi::MAX_NOTE; ++note) {
+        if (!sounding[note])
+            bank.voices[note].active = false;
+    }
+}
+
+template<FMAlgorithm ALGORITHM>
+void RenderFMLanes(const FMPatch& patch, std::span<const Voice> voices,
+    int sample_rate, std::span<Sample> dest)
+{
+    constexpr size_t ENVELOPE_STEP = 16;
+    constexpr float RADIANS_TO_CYCLES = 1 / (2 * M_PI);
+
+    const size_t operator_count = std::min(patch.operator_count, MAX_FM_OPERATORS);
+    const double seconds_per_sample = 1.0 / sample_rate;
+
+    FloatLanes phase[MAX_FM_OPERATORS] {}, increment[MAX_FM_OPERATORS] {};
+    FloatLanes level[MAX_FM_OPERATORS] {}, level_step[MAX_FM_OPERATORS] {};
+    FloatLanes gain {};
+
+    // Unused lanes keep a gain of zero
+    for (size_t lane = 0; lane < voices.size(); ++lane) {
+        const Voice& voice = voices[lane];
+        gain[lane] = voice.velocity * VOICE_VOLUME;
+
+        for (size_t op = 0; op < operator_count; ++op) {
+            double freq = voice.freq * patch.operators[op].ratio;
+            double cycles = voice.seconds_since_on * freq;
+            phase[op][lane] = cycles - floor(cycles);
+            increment[op][lane] = freq * seconds_per_sample;
+        }
+    }
+
+    auto operator_output = [&] (size_t op, FloatLanes modulation) -> FloatLanes {
+        if (op >= operator_count) return FloatLanes {};
+        return TableSine(phase[op] + modulation * RADIANS_TO_CYCLES) * level[op];
+    };
+
+    for (size_t i = 0; i < dest.size(); ++i) {
+        if (i % ENVELOPE_STEP == 0) {
+            for (size_t op = 0; op < operator_count; ++op) {
+                const FMOperator& fm_op = patch.operators[op];
+
+                for (size_t lane = 0; lane < voices.size(); ++lane) {
+                    double time = voices[lane].seconds_since_on + i * seconds_per_sample;
+                    float current = fm_op.envelope.Level(time) * fm_op.level;
+                    float target = fm_op.envelope.Level(
+                        time + ENVELOPE_STEP * seconds_per_sample) * fm_op.level;
+
+                    level[op][lane] = current;
+                    level_step[op][lane] = (target - current) / ENVELOPE_STEP;
+                    phase[op][lane] -= floorf(phase[op][lane]);
+                }
+            }
+        }
+
+        FloatLanes output;
+        if constexpr (ALGORITHM == FMAlgorithm::STACK) {
+            output = FloatLanes {};
+            for (size_t op = operator_count; op-- > 0;)
+                output = operator_output(op, output);
+        } else {
+            output = operator_output(0, operator_output(1, FloatLanes {}))
+                   + operator_output(2, operator_output(3, FloatLanes {}));
+        }
+
+        output *= gain;
+
+        float sum = 0;
+        for (size_t lane = 0; lane < SIMD_LANES; ++lane)
+            sum += output[lane];
+        dest[i] += sum;
+
+        for (size_t op = 0; op < operator_count; ++op) {
+            phase[op] += increment[op];
+            level[op] += level_step[op];
+        }
+    }
+}
+
+void RenderFM(const Synth& synth, Generator& generator,
+    std::span<const Voice> voices, std::span<Sample> dest)
+{
+    const FMPatch& patch = *synth.fm_patch;
+
+    // Voices are processed in groups, each voice in its own lane
+    for (size_t first = 0; first < voices.size(); first += SIMD_LANES) {
+        auto group = voices.subspan(first, std::min(SIMD_LANES, voices.size() - first));
+
+        switch (patch.algorithm) {
+        case FMAlgorithm::STACK:
+            RenderFMLanes<FMAlgorithm::STACK>(patch, group, generator.sample_rate, dest);
+            break;
+        case FMAlgorithm::TWO_STACKS:
+            RenderFMLanes<FMAlgorithm::TWO_STACKS>(patch, group,
+                generator.sample_rate, dest);
+            break;
+        }
+    }
+}
+
+void RenderAdditive(const Synth& synth, Generator& generator,
+    std::span<const Voice> voices, std::span<Sample> dest)
+{
+    // Envelopes are refreshed and phasors renormalised at this interval
+    constexpr size_t ENVELOPE_STEP = 16;
+    constexpr size_t MAX_GROUPS = MAX_PARTIALS / SIMD_LANES;
+
+    const AdditivePatch& patch = *synth.additive_patch;
+    const size_t partial_count = std::min(patch.partial_count, MAX_PARTIALS);
+    const size_t groups = (partial_count + SIMD_LANES - 1) / SIMD_LANES;
+    const double seconds_per_sample = 1.0 / generator.sample_rate;
+    const double nyquist = generator.sample_rate / 2.0;
+
+    for (const Voice& voice : voices) {
+        // Each partial is a unit phasor rotated by its frequency every sample,
+        // costing a few multiply-adds instead of a sinf. Silent lanes stay at 0.
+        FloatLanes cosine[MAX_GROUPS] {}, sine[MAX_GROUPS] {};
+        FloatLanes rotate_cosine[MAX_GROUPS] {}, rotate_sine[MAX_GROUPS] {};
+        FloatLanes level[MAX_GROUPS] {}, level_step[MAX_GROUPS] {};
+        std::array<bool, MAX_PARTIALS> audible {};
+
+        for (size_t p = 0; p < partial_count; ++p) {
+            double freq = voice.freq * patch.partials[p].ratio;
+            if (freq >= nyquist) continue;
+
+            double cycles = voice.seconds_since_on * freq;
+            double phase = 2 * M_PI * (cycles - floor(cycles));
+            double omega = 2 * M_PI * freq * seconds_per_sample;
+
+            size_t group = p / SIMD_LANES, lane = p % SIMD_LANES;
+            cosine[group][lane] = cos(phase);
+            sine[group][lane] = sin(phase);
+            rotate_cosine[group][lane] = cos(omega);
+            rotate_sine[group][lane] = sin(omega);
+            level[group][lane] = patch.partials[p].envelope.Level(voice.seconds_since_on)
+                               * patch.partials[p].amplitude;
+            audible[p] = true;
+        }
+
+        float gain = voice.velocity * VOICE_VOLUME;
+
+        for (size_t i = 0; i < dest.size(); ++i) {
+            if (i % ENVELOPE_STEP == 0) {
+                double time = voice.seconds_since_on
+                            + (i + ENVELOPE_STEP) * seconds_per_sample;
+
+                for (size_t p = 0; p < partial_count; ++p) {
+                    if (!audible[p]) continue;
+
+                    size_t group = p / SIMD_LANES, lane = p % SIMD_LANES;
+                    float target = patch.partials[p].envelope.Level(time)
+                                 * patch.partials[p].amplitude;
+                    level_step[group][lane] = (target - level[group][lane]) / ENVELOPE_STEP;
+                }
+
+                // Rounding slowly changes the phasors' magnitudes, so pull them
+                // back towards the unit circle with a first-order correction
+                for (size_t g = 0; g < groups; ++g) {
+                    FloatLanes correction
+                        = (3.f - (cosine[g] * cosine[g] + sine[g] * sine[g])) * 0.5f;
+                    cosine[g] *= correction;
+                    sine[g] *= correction;
+                }
+            }
+
+            FloatLanes sum {};
+            for (size_t g = 0; g < groups; ++g) {
+                sum += sine[g] * level[g];
+
+                FloatLanes next_cosine = cosine[g] * rotate_cosine[g]
+                                       - sine[g] * rotate_sine[g];
+                sine[g] = sine[g] * rotate_cosine[g] + cosine[g] * rotate_sine[g];
+                cosine[g] = next_cosine;
+                level[g] += level_step[g];
+            }
+
+            float total = 0;
+            for (size_t lane = 0; lane < SIMD_LANES; ++lane)
+                total += sum[lane];
+            dest[i] += total * gain;
+        }
+    }
+}
+
+void RenderAnalog(const Synth& synth, Generator& generator,
+    std::span<const Voice> voices, std::span<Sample> dest)
+{
+    const double seconds_per_sample = 1.0 / generator.sample_rate;
+    const float decay_common_ratio
+        = powf(2, -synth.decay_constant * seconds_per_sample);
+
+    for (size_t first = 0; first < voices.size(); first += SIMD_LANES) {
+        auto group = voices.subspan(first, std::min(SIMD_LANES, voices.size() - first));
+
+        // Lanes without a voice have no gain and a harmless phase increment
+        FloatLanes phase {}, increment {}, sub_phase {}, sub_increment {}, level {};
+        for (size_t lane = 0; lane < SIMD_LANES; ++lane) {
+            increment[lane] = sub_increment[lane] = 0.01f;
+            if (lane >= group.size()) continue;
+
+            const Voice& voice = group[lane];
+            double cycles = voice.seconds_since_on * voice.freq;
+            phase[lane] = cycles - floor(cycles);
+            sub_phase[lane] = cycles * 0.5 - floor(cycles * 0.5);
+            increment[lane] = voice.freq * seconds_per_sample;
+            sub_increment[lane] = increment[lane] * 0.5f;
+            level[lane] = voice.velocity * VOICE_VOLUME * 0.5f
+                * powf(2, -synth.decay_constant * voice.seconds_since_on);
+        }
+
+        for (Sample& sample : dest) {
+            FloatLanes output = waveforms::BandlimitedSaw(phase, increment)
+                + 0.5f * waveforms::BandlimitedPulse(sub_phase, sub_increment, 0.5f);
+            output *= level;
+
+            float sum = 0;
+            for (size_t lane = 0; lane < SIMD_LANES; ++lane)
+                sum += output[lane];
+            sample += sum;
+
+            phase += increment;
+            phase = phase >= 1.f ? phase - 1.f : phase;
+            sub_phase += sub_increment;
+            sub_phase = sub_phase >= 1.f ? sub_phase - 1.f : sub_phase;
+            level *= decay_common_ratio;
+        }
+    }
 }
 
 void Audio_LiveCallback_Safe(void* ctx, SDL_AudioStream* stream, int additional_amount,
@@ -82,13 +475,17 @@ void Audio_LiveCallback_Safe(void* ctx, SDL_AudioStream* stream, int additional_
 
     std::scoped_lock guard(sound_ctx->lock);
     size_t samples = generator.GenerateSamples(sample_buffer,
-        additional_amount, live_player, 0, DEFAULT_SYNTH);
+        additional_amount, live_player, 0, playback_unit.synth);
     SDL_PutAudioStreamData(stream, sample_buffer.data(), samples * sizeof(Sample));
 }
 
 void Audio_LiveCallback(void* ctx, SDL_AudioStream* stream, int additional_amount,
     int total_amount)
 {
+    auto* sound_ctx = static_cast<SoundContext*>(ctx);
+    realtime::CallbackScope scope(sound_ctx->live_playback.callback_stats, sound_ctx->realtime);
+    rtcheck::RealtimeScope realtime_scope("Audio_LiveCallback");
+
     try {
         Audio_LiveCallback_Safe(ctx, stream, additional_amount, total_amount);
     } catch (std::exception& e) {
@@ -97,63 +494,305 @@ void Audio_LiveCallback(void* ctx, SDL_AudioStream* stream, int additional_amoun
     }
 }
 
-void Audio_FileCallback_Safe(void* ctx, SDL_AudioStream* stream, int additional_amount,
-    int total_amount)
+void SampleScheduler::Anchor(const midi::Player& player, uint64_t scaled_usec,
+    uint64_t sample, int sample_rate)
 {
-    if (additional_amount < 1) return;
+    uint64_t rate = std::max<long>(std::lround(player.GetPlaybackRate() * RATE_ONE), 1);
+
+    anchor_scaled_usec_ = scaled_usec;
+    anchor_sample_ = sample;
+    samples_scale_ = static_cast<uint64_t>(sample_rate) * RATE_ONE;
+    scaled_usec_scale_ = player.GetMIDI()->ticks_per_quarter_note * 1000000ull * rate;
+    player_ = &player;
+    timeline_version_ = player.GetTimelineVersion();
+}
 
-    auto* sound_ctx = static_cast<SoundContext*>(ctx);
-    PlaybackUnit& playback_unit = sound_ctx->file_playback;
+auto SampleScheduler::IsAnchoredTo(const midi::Player& player) const -> bool
+{
+    return player_ == &player && timeline_version_ == player.GetTimelineVersion();
+}
+
+// Rounds down, so an event falls on the first sample at or after its exact time
+auto SampleScheduler::SampleAt(uint64_t scaled_usec) const -> uint64_t
+{
+    using uint128_t = unsigned __int128;
+
+    if (scaled_usec >= anchor_scaled_usec_) {
+        return anchor_sample_ + static_cast<uint128_t>(scaled_usec - anchor_scaled_usec_)
+            * samples_scale_ / scaled_usec_scale_;
+    }
+
+    uint128_t before = (static_cast<uint128_t>(anchor_scaled_usec_ - scaled_usec)
+        * samples_scale_ + scaled_usec_scale_ - 1) / scaled_usec_scale_;
+    return anchor_sample_ - std::min<uint128_t>(before, anchor_sample_);
+}
+
+auto SampleScheduler::ScaledUsecAt(uint64_t sample) const -> uint64_t
+{
+    if (sample < anchor_sample_)
+        return anchor_scaled_usec_;
+
+    return anchor_scaled_usec_ + static_cast<unsigned __int128>(sample - anchor_sample_)
+        * scaled_usec_scale_ / samples_scale_;
+}
+
+void Metronome::Allocate(int sample_rate)
+{
+    constexpr float CLICK_SECONDS = 0.03f, CLICK_DECAY = 150.f;
+
+    auto render = [sample_rate] (std::vector<Sample>& dest, float freq, float level) {
+        dest.resize(static_cast<size_t>(CLICK_SECONDS * sample_rate));
+        for (size_t i = 0; i < dest.size(); ++i) {
+            float seconds = static_cast<float>(i) / sample_rate;
+            dest[i] = level * sinf(2 * M_PI * freq * seconds)
+                    * expf(-CLICK_DECAY * seconds);
+        }
+    };
+
+    render(accent_click, 1760.f, 0.6f);
+    render(click, 1320.f, 0.4f);
+}
 
+// Mixes as much of the sounding click as fits into dest
+void MixClickTail(Metronome& metronome, std::span<Sample> dest)
+{
+    size_t count = std::min(dest.size(), metronome.sounding.size());
+    for (size_t i = 0; i < count; ++i)
+        dest[i] += metronome.sounding[i];
+    metronome.sounding = metronome.sounding.subspan(count);
+}
+
+void StartClick(Metronome& metronome, bool accent)
+{
+    metronome.sounding = accent ? metronome.accent_click : metronome.click;
+}
+
+// Mixes the clicks for a block of file playback beginning at first_sample, as
+// placed by the scheduler
+void MixBeats(PlaybackUnit& playback_unit, std::span<Sample> block, uint64_t first_sample)
+{
+    Metronome& metronome = playback_unit.metronome;
+    const midi::Player& player = playback_unit.player;
+    const midi::MIDI& midi = *player.GetMIDI();
+
+    if (metronome.timeline_version != player.GetTimelineVersion()) {
+        metronome.next_beat = std::ranges::lower_bound(midi.beats,
+            player.GetTicksElapsed(), {}, &midi::Beat::tick) - midi.beats.begin();
+        metronome.timeline_version = player.GetTimelineVersion();
+    }
+
+    bool enabled = metronome.enabled.load(std::memory_order_relaxed);
+    size_t offset = 0;
+
+    for (; metronome.next_beat < midi.beats.size(); ++metronome.next_beat) {
+        const midi::Beat& beat = midi.beats[metronome.next_beat];
+        uint64_t beat_sample = playback_unit.scheduler.SampleAt(
+            midi.tempo_map.ScaledUsecAt(beat.tick));
+        if (beat_sample >= first_sample + block.size())
+            break;
+
+        size_t click_offset = std::max<uint64_t>(beat_sample, first_sample + offset)
+                            - first_sample;
+        MixClickTail(metronome, block.subspan(offset, click_offset - offset));
+        offset = click_offset;
+
+        if (enabled)
+            StartClick(metronome, beat.downbeat);
+    }
+
+    MixClickTail(metronome, block.subspan(offset));
+}
+
+// Spreads a cue's count-in clicks evenly over its pause, accenting the first
+void MixCountIn(PlaybackUnit& playback_unit, std::span<Sample> block)
+{
+    Metronome& metronome = playback_unit.metronome;
+    const Transport& transport = playback_unit.transport;
+    const uint32_t beats = transport.current->count_in_beats;
+    const uint64_t pause_samples = transport.current->pause_samples;
+    const uint64_t first_sample = transport.pause_position;
+    size_t offset = 0;
+
+    for (uint32_t beat = 0; beat < beats; ++beat) {
+        uint64_t beat_sample = pause_samples * beat / beats;
+        if (beat_sample < first_sample) continue;
+        if (beat_sample >= first_sample + block.size()) break;
+
+        size_t click_offset = beat_sample - first_sample;
+        MixClickTail(metronome, block.subspan(offset, click_offset - offset));
+        offset = click_offset;
+        StartClick(metronome, beat == 0);
+    }
+
+    MixClickTail(metronome, block.subspan(offset));
+}
+
+void ReportCue(const Cue& cue, CueState state)
+{
+    TransportEvent ev { .tag = cue.tag, .state = state };
+    SDL_PushEvent(reinterpret_cast<SDL_Event*>(&ev));
+}
+
+// Moves on to the next queued cue once the current one has finished. Returns
+// false when there is nothing left to play.
+auto AdvanceTransport(PlaybackUnit& playback_unit) -> bool
+{
+    Transport& transport = playback_unit.transport;
+    midi::Player& player = playback_unit.player;
+
+    if (transport.current) {
+        if (transport.pause_samples_left > 0 || !player.Done())
+            return true;
+
+        ReportCue(*transport.current, CueState::ENDED);
+        transport.current.reset();
+    }
+
+    std::optional<Cue> cue = transport.cues.Pop();
+    if (!cue) return false;
+
+    switch (cue->type) {
+    case Cue::PLAY_MIDI:
+        player.SetMIDI(*cue->midi);
+        player.transposition_offset_ = cue->transposition;
+        break;
+    case Cue::PLAY_STREAM:
+        player.SetStream(*cue->stream);
+        player.transposition_offset_ = cue->transposition;
+        break;
+    case Cue::PAUSE:
+        transport.pause_samples_left = cue->pause_samples;
+        transport.pause_position = 0;
+        break;
+    }
+
+    playback_unit.sample_position = 0;
+    transport.current = cue;
+    ReportCue(*cue, CueState::STARTED);
+    return true;
+}
+
+// Brings the schedule up to date with jumps in the player and with a new
+// playback rate, which applies from the current sample
+void UpdateSchedule(PlaybackUnit& playback_unit)
+{
+    midi::Player& player = playback_unit.player;
+    SampleScheduler& scheduler = playback_unit.scheduler;
+    const uint64_t position = playback_unit.sample_position;
+    const int sample_rate = playback_unit.generator.sample_rate;
+
+    if (!scheduler.IsAnchoredTo(player)) {
+        scheduler.Anchor(player, player.ScaledUsecAt(player.GetTicksElapsed()),
+            position, sample_rate);
+    }
+
+    float playback_rate = playback_unit.playback_rate.load(std::memory_order_relaxed);
+    if (playback_rate == player.GetPlaybackRate())
+        return;
+
+    // Whole ticks already played in the current gap are committed at the old
+    // rate, and the new mapping starts from the exact time reached
+    uint64_t scaled_usec = scheduler.ScaledUsecAt(position);
+    midi::Ticks ticks_elapsed = player.GetTicksElapsed();
+    midi::Ticks ticks_reached = std::max(player.TicksAtScaledUsec(scaled_usec),
+        ticks_elapsed);
+    midi::Ticks ticks_into_gap = std::min(ticks_reached - ticks_elapsed,
+        player.TicksUntilNextEvent().value_or(0));
+
+    player.SetPlaybackRate(playback_rate, ticks_into_gap);
+    scheduler.Anchor(player, scaled_usec, position, sample_rate);
+}
+
+auto RenderFilePlayback(PlaybackUnit& playback_unit, size_t count) -> size_t
+{
     Generator& generator = playback_unit.generator;
     midi::Player& file_player = playback_unit.player;
+    Transport& transport = playback_unit.transport;
+    SampleScheduler& scheduler = playback_unit.scheduler;
     std::span<Sample> sample_buffer = playback_unit.sample_buffer.view();
-    unsigned& samples_since_last_event = playback_unit.samples_since_last_event;
+    uint64_t& position = playback_unit.sample_position;
 
     std::ranges::fill(sample_buffer, Sample {});
 
-    float samples_per_tick = generator.sample_rate / file_player.GetTicksPerSecond();
     size_t samples = 0;
 
-    while (samples < static_cast<size_t>(additional_amount)) {
-        std::optional<midi::Ticks> ticks = file_player.TicksUntilNextEvent();
-        if (!ticks) break;
+    while (samples < count) {
+        if (!AdvanceTransport(playback_unit))
+            break;
 
-        samples_per_tick = generator.sample_rate / file_player.GetTicksPerSecond();
         std::span<Sample> sample_buffer_range {
             sample_buffer.begin() + samples,
             sample_buffer.end()
         };
 
-        size_t requested_samples = tb::get_unchecked(ticks) * samples_per_tick
-            - samples_since_last_event;
+        if (transport.pause_samples_left > 0) {
+            size_t samples_generated = generator.GenerateSamples(sample_buffer_range,
+                transport.pause_samples_left, file_player, 0, playback_unit.synth);
+
+            MixCountIn(playback_unit, sample_buffer_range.first(samples_generated));
+
+            samples += samples_generated;
+            position += samples_generated;
+            transport.pause_samples_left -= samples_generated;
+            transport.pause_position += samples_generated;
+
+            if (transport.pause_samples_left > 0)
+                break;
+            continue;
+        }
+
+        UpdateSchedule(playback_unit);
+
+        // None at the end, or while a stream's decoder catches up
+        std::optional<midi::Ticks> ticks = file_player.TicksUntilNextEvent();
+        if (!ticks) break;
+
+        midi::Ticks ticks_elapsed = file_player.GetTicksElapsed();
+        uint64_t current_sample = scheduler.SampleAt(file_player.ScaledUsecAt(ticks_elapsed));
+        uint64_t next_event_sample = scheduler.SampleAt(
+            file_player.ScaledUsecAt(ticks_elapsed + tb::get_unchecked(ticks)));
+
+        size_t requested_samples
+            = next_event_sample > position ? next_event_sample - position : 0;
+        auto sample_offset = static_cast<unsigned>(position - std::min(current_sample, position));
+
         size_t samples_generated = generator.GenerateSamples(sample_buffer_range,
-            requested_samples, file_player, samples_since_last_event, DEFAULT_SYNTH);
+            requested_samples, file_player, sample_offset, playback_unit.synth);
+        MixBeats(playback_unit, sample_buffer_range.first(samples_generated), position);
 
         samples += samples_generated;
+        position += samples_generated;
 
-        if (samples_generated < requested_samples) {
-            samples_since_last_event += samples_generated;
+        if (samples_generated < requested_samples)
             break;
-        }
-
-        samples_since_last_event = 0;
 
         if (file_player.Advance().is_error())
             break;
-
-        if (file_player.Done()) {
-            MIDIPlayerEndEvent ev {};
-            SDL_PushEvent(reinterpret_cast<SDL_Event*>(&ev));
-        }
     }
 
-    SDL_PutAudioStreamData(stream, sample_buffer.data(), samples * sizeof(Sample));
+    return samples;
+}
+
+void Audio_FileCallback_Safe(void* ctx, SDL_AudioStream* stream, int additional_amount,
+    int total_amount)
+{
+    if (additional_amount < 1) return;
+
+    auto* sound_ctx = static_cast<SoundContext*>(ctx);
+    PlaybackUnit& playback_unit = sound_ctx->file_playback;
+
+    size_t samples = RenderFilePlayback(playback_unit, additional_amount);
+    SDL_PutAudioStreamData(stream, playback_unit.sample_buffer.view().data(),
+        samples * sizeof(Sample));
 }
 
 void Audio_FileCallback(void* ctx, SDL_AudioStream* stream, int additional_amount,
     int total_amount)
 {
+    auto* sound_ctx = static_cast<SoundContext*>(ctx);
+    realtime::CallbackScope scope(sound_ctx->file_playback.callback_stats, sound_ctx->realtime);
+    rtcheck::RealtimeScope realtime_scope("Audio_FileCallback");
+
     try {
         Audio_FileCallback_Safe(ctx, stream, additional_amount, total_amount);
     } catch (std::exception& e) {
@@ -161,3 +800,35 @@ void Audio_FileCallback(void* ctx, SDL_AudioStream* stream, int additional_amoun
         throw;
     }
 }
+
+// Everything the callbacks touch outside the stack, so none of it can be paged
+// out or faulted in mid-callback
+auto LockAudioMemory(SoundContext& sound_ctx) -> tb::error<realtime::Error>
+{
+    const std::array<std::span<const std::byte>, 9> regions {
+        std::as_bytes(std::span(SINE_TABLE)),
+        std::as_bytes(std::span(NOTE_TO_FREQUENCY_TABLE)),
+        std::as_bytes(sound_ctx.live_playback.sample_buffer.view()),
+        std::as_bytes(sound_ctx.file_playback.sample_buffer.view()),
+        std::as_bytes(std::span(sound_ctx.live_playback.generator.strings.pool)),
+        std::as_bytes(std::span(sound_ctx.file_playback.generator.strings.pool)),
+        std::as_bytes(std::span(sound_ctx.file_playback.metronome.accent_click)),
+        std::as_bytes(std::span(sound_ctx.file_playback.metronome.click)),
+        std::as_bytes(std::span(&sound_ctx, 1))
+    };
+
+    for (std::span<const std::byte> region : regions) {
+        if (auto result = realtime::LockMemory(region); result.is_error())
+            return result;
+    }
+
+    // A SoundFont loaded already. One loaded later is locked as it is selected.
+    for (const PlaybackUnit* unit : { &sound_ctx.live_playback, &sound_ctx.file_playback }) {
+        if (!unit->synth.instrument) continue;
+        if (auto result = sf2::LockInstrumentMemory(*unit->synth.instrument);
+            result.is_error())
+            return result;
+    }
+
+    return tb::ok;
+}
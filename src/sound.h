@@ -1,6 +1,7 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cmath>
 #include <mutex>
 #include <span>
@@ -11,6 +12,9 @@
 #include <SDL3/SDL_audio.h>
 
 #include "midi.h"
+#include "midistream.h"
+#include "queue.h"
+#include "realtime.h"
 
 constexpr int DEFAULT_SAMPLE_RATE = 4000;
 constexpr size_t SAMPLE_BUFFER_SIZE = 4096;
@@ -37,10 +41,87 @@ constexpr float CompositeWaveform(float freq, unsigned time, unsigned wavelength
     return (Fns(freq, time, wavelength) + ...);
 }
 
+constexpr float VOICE_VOLUME = 0.3f;
+
+// Four floats fill an SSE or NEON register
+constexpr size_t SIMD_LANES = 4;
+using FloatLanes = float __attribute__((vector_size(SIMD_LANES * sizeof(float))));
+
+namespace sf2 { struct Instrument; }
+
+struct Generator;
+struct Synth;
+struct FMPatch;
+struct AdditivePatch;
+
+// Delay-attack-hold-decay-sustain-release envelope, times in seconds, sustain
+// as a linear gain. Decay and release are the times taken to fall 100dB.
+struct Envelope
+{
+    float delay = 0, attack = 0, hold = 0, decay = 0, sustain = 1, release = 0;
+
+    auto Level(double seconds) const -> float;
+    // Falling from wherever the envelope was when the note was released
+    auto ReleasedLevel(double seconds, double seconds_since_off) const -> float;
+};
+
+// One sounding note, as seen by a synth at the start of a block
+struct Voice
+{
+    uint8_t note;           // Transposed MIDI key number
+    float velocity;         // 0 to 1
+    float freq;
+    double seconds_since_on;
+    double seconds_since_off;   // Negative while the note is held
+    midi::Ticks onset;      // Identifies the note-on for stateful synths
+};
+
+using RenderFunction = void (*)(const Synth&, Generator&, std::span<const Voice>,
+                                std::span<Sample>);
+
+void RenderWaveform(const Synth& synth, Generator& generator,
+                    std::span<const Voice> voices, std::span<Sample> dest);
+void RenderString(const Synth& synth, Generator& generator,
+                  std::span<const Voice> voices, std::span<Sample> dest);
+void RenderFM(const Synth& synth, Generator& generator,
+              std::span<const Voice> voices, std::span<Sample> dest);
+void RenderAdditive(const Synth& synth, Generator& generator,
+                    std::span<const Voice> voices, std::span<Sample> dest);
+void RenderAnalog(const Synth& synth, Generator& generator,
+                  std::span<const Voice> voices, std::span<Sample> dest);
+
 struct Synth
 {
     WaveFunction wave_fn = nullptr;
     float decay_constant = 0;
+    RenderFunction render_fn = RenderWaveform;
+    const sf2::Instrument* instrument = nullptr;
+    float release = 0;      // Seconds released notes are still given as voices
+    const FMPatch* fm_patch = nullptr;
+    const AdditivePatch* additive_patch = nullptr;
+    std::string_view name = "default";
+};
+
+constexpr size_t MAX_FM_OPERATORS = 4;
+
+enum class FMAlgorithm
+{
+    STACK,      // Each operator modulates the one below it, operator 0 is heard
+    TWO_STACKS  // 1 modulates 0 and 3 modulates 2, operators 0 and 2 are heard
+};
+
+struct FMOperator
+{
+    float ratio = 1;    // Frequency relative to the note
+    float level = 1;    // Output gain for carriers, modulation index for modulators
+    Envelope envelope;
+};
+
+struct FMPatch
+{
+    FMAlgorithm algorithm = FMAlgorithm::STACK;
+    size_t operator_count = 2;
+    std::array<FMOperator, MAX_FM_OPERATORS> operators {};
 };
 
 namespace waveforms
@@ -60,20 +141,178 @@ constexpr auto sine = [] (float freq, unsigned time, unsigned wavelength) {
     return sinf(time * 2.f * M_PI * freq / wavelength);
 };
 
+// Polynomial approximation of a band-limited step, subtracted around each
+// discontinuity. Phase and increment are in cycles, and T is either a float or
+// FloatLanes so that the scalar and SIMD paths share one implementation.
+template<typename T>
+constexpr auto PolyBLEP(T phase, T increment) -> T
+{
+    T after = phase / increment;
+    T before = (phase - 1) / increment;
+    return phase < increment ? after + after - after * after - 1
+         : phase > 1 - increment ? before * before + before + before + 1
+         : T {};
+}
+
+template<typename T>
+constexpr auto Wrap(T phase) -> T
+{
+    return phase >= 1 ? phase - 1 : phase;
+}
+
+template<typename T>
+constexpr auto BandlimitedSaw(T phase, T increment) -> T
+{
+    return 2 * phase - 1 - PolyBLEP(phase, increment);
+}
+
+// Width is the fraction of each cycle spent high
+template<typename T>
+constexpr auto BandlimitedPulse(T phase, T increment, float width) -> T
+{
+    T naive = phase < width ? T {} + 1 : T {} - 1;
+    return naive + PolyBLEP(phase, increment)
+         - PolyBLEP(Wrap(phase + (1 - width)), increment);
+}
+
+// Phase of a wave function's oscillator, computed in double precision as
+// sample counts grow large
+constexpr auto Phase(float freq, unsigned time, unsigned wavelength) -> float
+{
+    double cycles = static_cast<double>(time) * freq / wavelength;
+    return cycles - static_cast<int64_t>(cycles);
+}
+
+constexpr auto bandlimited_saw = [] (float freq, unsigned time, unsigned wavelength) {
+    return BandlimitedSaw(Phase(freq, time, wavelength), freq / wavelength);
+};
+
+constexpr auto bandlimited_square
+    = [] (float freq, unsigned time, unsigned wavelength) {
+    return BandlimitedPulse(Phase(freq, time, wavelength), freq / wavelength, 0.5f);
+};
+
+// Same shape and level as pulse, without the aliasing
+constexpr auto bandlimited_pulse
+    = [] (float freq, unsigned time, unsigned wavelength) {
+    return 0.5f * bandlimited_square(freq, time, wavelength);
+};
+
 }
 
 constexpr Synth DEFAULT_SYNTH {
     .wave_fn = CompositeWaveform<
-        Waveform<waveforms::pulse>, Waveform<waveforms::sine, 2, 128>,
+        Waveform<waveforms::bandlimited_pulse>, Waveform<waveforms::sine, 2, 128>,
         Waveform<waveforms::sine, 3, 64>
     >,
     .decay_constant = 1 / 0.3f
 };
 
+// Karplus-Strong string, decay_constant sets how quickly the string loses energy
+constexpr Synth STRING_SYNTH {
+    .decay_constant = 1 / 0.9f,
+    .render_fn = RenderString,
+    .name = "string"
+};
+
+// Sawtooth with a square one octave below, rendered across SIMD lanes
+constexpr Synth ANALOG_SYNTH {
+    .decay_constant = 1 / 0.6f,
+    .render_fn = RenderAnalog,
+    .name = "analog"
+};
+
+// Bright tine over a soft body, after the classic electric piano patches
+constexpr FMPatch ELECTRIC_PIANO_PATCH {
+    .algorithm = FMAlgorithm::TWO_STACKS,
+    .operator_count = 4,
+    .operators = {{
+        { .ratio = 1, .level = 0.6f,
+          .envelope = { .attack = 0.002f, .decay = 6.f, .sustain = 0.f } },
+        { .ratio = 1, .level = 1.2f,
+          .envelope = { .attack = 0.002f, .decay = 3.f, .sustain = 0.2f } },
+        { .ratio = 1, .level = 0.4f,
+          .envelope = { .attack = 0.001f, .decay = 1.5f, .sustain = 0.f } },
+        { .ratio = 14, .level = 2.f,
+          .envelope = { .attack = 0.001f, .decay = 0.4f, .sustain = 0.f } }
+    }}
+};
+
+constexpr Synth FM_SYNTH {
+    .render_fn = RenderFM,
+    .fm_patch = &ELECTRIC_PIANO_PATCH,
+    .name = "fm"
+};
+
+constexpr size_t MAX_PARTIALS = 32;
+
+struct Partial
+{
+    float ratio = 1;        // Frequency relative to the note
+    float amplitude = 0;
+    Envelope envelope;
+};
+
+struct AdditivePatch
+{
+    size_t partial_count = 0;
+    std::array<Partial, MAX_PARTIALS> partials {};
+};
+
+// Pipe organ with a strong fundamental, upper partials speaking slightly late
+// and settling to a quieter sustain
+constexpr AdditivePatch ORGAN_PATCH = [] {
+    AdditivePatch patch { .partial_count = 24 };
+    for (size_t i = 0; i < patch.partial_count; ++i) {
+        float harmonic = i + 1;
+        bool octave = (i & (i + 1)) == 0;   // Harmonics 1, 2, 4, 8, 16
+        patch.partials[i] = {
+            .ratio = harmonic,
+            .amplitude = (octave ? 0.5f : 0.25f) / harmonic,
+            .envelope = {
+                .attack = 0.01f + 0.002f * i,
+                .decay = 4.f / harmonic,
+                .sustain = 1.f / (1 + 0.1f * i)
+            }
+        };
+    }
+    return patch;
+}();
+
+constexpr Synth ORGAN_SYNTH {
+    .render_fn = RenderAdditive,
+    .additive_patch = &ORGAN_PATCH,
+    .name = "organ"
+};
+
+// Waveguide state for one key
+struct StringVoice
+{
+    std::span<float> delay_line;   // Capacity for the key's lowest tuning
+    size_t length = 0, position = 0;
+    float last_output = 0;
+    float allpass_coefficient = 0, allpass_input = 0, allpass_output = 0;
+    float loss = 1;
+    midi::Ticks onset = 0;
+    bool active = false;
+};
+
+// One delay line per key, all carved from a single allocation made before
+// playback starts so no key ever has to wait for a free line
+struct StringBank
+{
+    std::vector<float> pool;
+    std::array<StringVoice, midi::MAX_NOTE + 1> voices {};
+    uint32_t noise_state = 0x9E3779B9;
+
+    void Allocate(int sample_rate);
+};
+
 struct Generator
 {
     int sample_rate = DEFAULT_SAMPLE_RATE;
     unsigned sample_point = 0;
+    StringBank strings;
 
     auto GenerateSamples(std::span<Sample> dest, size_t count,
                          const midi::Player& midi_status, unsigned sample_offset,
@@ -81,21 +320,103 @@ struct Generator
     -> size_t;
 };
 
+// Click sounds rendered once up front, and the clicks being mixed into file
+// playback. Beats come from the MIDI and are placed by the file scheduler, so
+// clicks follow tempo changes, rate changes, seeks and loops.
+struct Metronome
+{
+    std::vector<Sample> accent_click, click;
+    std::atomic<bool> enabled = false;  // Written by the main thread
+
+    // Audio thread only
+    size_t next_beat = 0;
+    uint32_t timeline_version = 0;
+    std::span<const Sample> sounding;   // Remainder of the click being played
+
+    void Allocate(int sample_rate);
+};
+
+// One item of a file playback timeline. Cues play back to back, so the
+// spacing between them is exact to the sample.
+struct Cue
+{
+    enum Type { PLAY_MIDI, PLAY_STREAM, PAUSE } type;
+    const midi::MIDI* midi = nullptr;
+    // Drains as it plays, so played by one cue only. Like midi, kept alive by
+    // whoever queued the cue until a later cue has started.
+    midi::MIDIStream* stream = nullptr;
+    uint8_t transposition = 0;
+    uint32_t pause_samples = 0;
+    uint32_t count_in_beats = 0;    // Clicks spread evenly over a pause
+    uint32_t tag = 0;   // Reported back in TransportEvent
+};
+
+constexpr size_t MAX_QUEUED_CUES = 16;
+
+struct Transport
+{
+    SPSCQueue<Cue, MAX_QUEUED_CUES> cues;   // Pushed by the main thread
+
+    // Audio thread only
+    std::optional<Cue> current;
+    uint32_t pause_samples_left = 0;
+    uint32_t pause_position = 0;
+};
+
+// Places MIDI events at absolute sample positions using integer arithmetic on
+// the tempo map's exact time, so rounding never accumulates from one event to
+// the next and placement is identical between runs. The mapping is anchored
+// afresh whenever it changes: a new MIDI, a seek or a loop wrap, or a new
+// playback rate.
+class SampleScheduler
+{
+public:
+    // Playback rates are fixed point with 16 fractional bits
+    static constexpr uint32_t RATE_ONE = 1 << 16;
+
+    void Anchor(const midi::Player& player, uint64_t scaled_usec, uint64_t sample,
+                int sample_rate);
+    auto IsAnchoredTo(const midi::Player& player) const -> bool;
+    auto SampleAt(uint64_t scaled_usec) const -> uint64_t;
+    auto ScaledUsecAt(uint64_t sample) const -> uint64_t;
+
+private:
+    uint64_t anchor_scaled_usec_ = 0, anchor_sample_ = 0;
+    // Samples per scaled microsecond is samples_scale_ / scaled_usec_scale_
+    uint64_t samples_scale_ = 1, scaled_usec_scale_ = 1;
+    const midi::Player* player_ = nullptr;
+    uint32_t timeline_version_ = 0;
+};
+
 struct PlaybackUnit
 {
     midi::Player player;
     tb::dynamically_allocated_array<Sample, SAMPLE_BUFFER_SIZE> sample_buffer {};
     UAudioStream stream;
     Generator generator;
-    unsigned samples_since_last_event = 0;
+    Synth synth = DEFAULT_SYNTH;
+    uint64_t sample_position = 0;   // Samples played since the current cue started
+    SampleScheduler scheduler;
+    Metronome metronome;
+    realtime::CallbackStats callback_stats;
+    std::atomic<float> playback_rate = 1.f;   // Written by the main thread
+    Transport transport;
 };
 
 struct SoundContext
 {
     PlaybackUnit live_playback, file_playback;
     std::mutex lock;
+    bool realtime = false;  // Harden the audio threads, set before streams start
 };
 
+auto LockAudioMemory(SoundContext& sound_ctx) -> tb::error<realtime::Error>;
+
+// Renders the transport's cues into the unit's sample buffer until at least
+// count samples are ready or the buffer is full, returning how many were
+// rendered. Used by the file callback, and directly for offline rendering.
+auto RenderFilePlayback(PlaybackUnit& playback_unit, size_t count) -> size_t;
+
 void Audio_LiveCallback(void* ctx, SDL_AudioStream* stream, int additional_amount,
                         int total_amount);
 void Audio_FileCallback(void* ctx, SDL_AudioStream* stream, int additional_amount,
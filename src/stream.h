@@ -1,6 +1,10 @@
 #pragma once
 
+#include <array>
 #include <cstdio>
+#include <cstring>
+#include <tuple>
+#include <utility>
 
 #include <tb/tb.h>
 
@@ -11,6 +15,19 @@ enum class StreamError
 
 struct Stream;
 
+// Read as the bytes of the value itself, so a run of them can be read at once
+template<typename T>
+concept FixedWidthField = std::integral<T> || std::is_enum_v<T>;
+
+template<typename... Ts>
+constexpr auto FieldOffsets() -> std::array<size_t, sizeof...(Ts)>
+{
+    std::array<size_t, sizeof...(Ts)> offsets {};
+    size_t offset = 0, i = 0;
+    ((offsets[i++] = offset, offset += sizeof(Ts)), ...);
+    return offsets;
+}
+
 template<typename T>
 auto TypedRead(Stream stream) -> tb::result<T, StreamError>;
 
@@ -57,27 +74,58 @@ struct Stream
     auto Read(tb::type_tag_t<Ts...>, const Transform& fn = identity_transform)
     -> tb::result<std::tuple<Ts...>, StreamError>
     {
-        std::tuple<Ts...> result;
-        bool okay = true;
-        StreamError error;
-        for (size_t i = 0; i < sizeof...(Ts); ++i) {
-            tb::visit_tuple(result, i, [&] (auto& elem) {
-                using ElementType = std::remove_reference_t<decltype(elem)>;
-                auto result = TypedRead(tb::type_tag<ElementType>, *this);
-                if (result.is_error()) {
-                    error = result.get_error();
-                    okay = false;
-                    return;
-                }
-                elem = result.get_unchecked();
-                if constexpr (requires { elem = fn(elem); })
-                    elem = fn(elem);
-                else
-                    fn(elem);
-            });
-
-            if (!okay) return error;
+        // Variable-width fields are read one at a time
+        if constexpr ((FixedWidthField<Ts> && ...)) {
+            return ReadFixed<Ts...>(fn);
+        } else {
+            std::tuple<Ts...> result;
+            bool okay = true;
+            StreamError error;
+            for (size_t i = 0; i < sizeof...(Ts); ++i) {
+                tb::visit_tuple(result, i, [&] (auto& elem) {
+                    using ElementType = std::remove_reference_t<decltype(elem)>;
+                    auto result = TypedRead(tb::type_tag<ElementType>, *this);
+                    if (result.is_error()) {
+                        error = result.get_error();
+                        okay = false;
+                        return;
+                    }
+                    elem = result.get_unchecked();
+                    if constexpr (requires { elem = fn(elem); })
+                        elem = fn(elem);
+                    else
+                        fn(elem);
+                });
+
+                if (!okay) return error;
+            }
+
+            return result;
         }
+    }
+
+    // One fread for the whole record, with each field decoded from its offset
+    template<typename... Ts, typename Transform>
+    auto ReadFixed(const Transform& fn) -> tb::result<std::tuple<Ts...>, StreamError>
+    {
+        constexpr auto offsets = FieldOffsets<Ts...>();
+        std::array<std::byte, (sizeof(Ts) + ...)> bytes;
+
+        if (fread(bytes.data(), bytes.size(), 1, file_) < 1)
+            return StreamError::FILE_ERROR;
+
+        std::tuple<Ts...> result;
+        auto decode = [&] (auto& elem, size_t offset) {
+            memcpy(&elem, bytes.data() + offset, sizeof(elem));
+            if constexpr (requires { elem = fn(elem); })
+                elem = fn(elem);
+            else
+                fn(elem);
+        };
+
+        [&] <size_t... I> (std::index_sequence<I...>) {
+            (decode(std::get<I>(result), offsets[I]), ...);
+        }(std::index_sequence_for<Ts...> {});
 
         return result;
     }
@@ -87,7 +135,7 @@ struct Stream
     auto Position() -> tb::result<size_t, StreamError>;
 };
 
-template<typename T> requires std::integral<T> || std::is_enum_v<T>
+template<FixedWidthField T>
 auto TypedRead(Stream stream) -> tb::result<T, StreamError>
 {
     T result;
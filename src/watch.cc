@@ -0,0 +1,206 @@
+#include "watch.h"
+
+#include <SDL3/SDL_events.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Editors often save in several steps, so a file is only re-read once it has
+// gone this long without changing
+constexpr int SETTLE_MS = 100;
+
+constexpr uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO;
+
+auto NormalPath(std::string_view path) -> std::string
+{
+    return std::filesystem::path(path).lexically_normal();
+}
+
+ResourceWatcher::ResourceWatcher(std::string manifest_path, MIDICache* cache)
+    : manifest_path_(NormalPath(manifest_path)), cache_(cache) {}
+
+ResourceWatcher::~ResourceWatcher()
+{
+    if (thread_.joinable()) {
+        uint64_t stop = 1;
+        write(stop_fd_, &stop, sizeof(stop));
+        thread_.join();
+    }
+
+    if (inotify_fd_ != -1) close(inotify_fd_);
+    if (stop_fd_ != -1) close(stop_fd_);
+}
+
+auto ResourceWatcher::Start() -> tb::error<WatchError>
+{
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ == -1)
+        return WatchError { WatchError::INOTIFY_FAILED, errno };
+
+    stop_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd_ == -1)
+        return WatchError { WatchError::EVENTFD_FAILED, errno };
+
+    {
+        std::scoped_lock guard(lock_);
+        AddWatch(manifest_path_);
+    }
+
+    thread_ = std::thread([this] {
+        try {
+            Run();
+        } catch (std::exception& e) {
+            tb::print("Exception occurred: {}\n", e.what());
+            throw;
+        }
+    });
+
+    return tb::ok;
+}
+
+void ResourceWatcher::WatchFiles(std::span<const std::string> paths)
+{
+    std::scoped_lock guard(lock_);
+
+    files_.clear();
+    AddWatch(manifest_path_);
+    for (const std::string& path : paths)
+        AddWatch(NormalPath(path));
+}
+
+auto ResourceWatcher::TakeUpdate() -> std::optional<ResourceUpdate>
+{
+    std::scoped_lock guard(lock_);
+    return std::exchange(pending_, std::nullopt);
+}
+
+// Called with the lock held. inotify gives back the same descriptor for a
+// directory that is already watched.
+void ResourceWatcher::AddWatch(const std::string& path)
+{
+    files_.insert(path);
+
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    if (directory.empty())
+        directory = ".";
+
+    int wd = inotify_add_watch(inotify_fd_, directory.c_str(), WATCH_EVENTS);
+    if (wd == -1) {
+        tb::print("Couldn't watch '{}' for changes: {}\n", directory.string(),
+            strerror(errno));
+        return;
+    }
+
+    directories_.try_emplace(wd, directory.string());
+}
+
+void ResourceWatcher::Run()
+{
+    std::array<pollfd, 2> fds {{
+        { .fd = inotify_fd_, .events = POLLIN },
+        { .fd = stop_fd_, .events = POLLIN }
+    }};
+    std::unordered_set<std::string> changed;
+
+    while (true) {
+        // Waits indefinitely until something changes, then until it settles
+        int ready = poll(fds.data(), fds.size(), changed.empty() ? -1 : SETTLE_MS);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready == -1 || fds[1].revents != 0)
+            return;
+
+        if (fds[0].revents & POLLIN) {
+            ReadChanges(changed);
+        } else if (!changed.empty()) {
+            LoadChanges(changed);
+            changed.clear();
+        }
+    }
+}
+
+void ResourceWatcher::ReadChanges(std::unordered_set<std::string>& changed)
+{
+    alignas(inotify_event) char buffer[4096];
+
+    ssize_t length;
+    while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+        std::scoped_lock guard(lock_);
+
+        for (ssize_t i = 0; i < length;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(buffer + i);
+            i += sizeof(inotify_event) + event->len;
+
+            // Events were lost, so anything may have changed
+            if (event->mask & IN_Q_OVERFLOW) {
+                changed.insert(files_.begin(), files_.end());
+                continue;
+            }
+
+            auto directory = directories_.find(event->wd);
+            if (directory == directories_.end() || event->len == 0)
+                continue;
+
+            std::string path = NormalPath(directory->second + "/" + event->name);
+            if (files_.contains(path))
+                changed.insert(std::move(path));
+        }
+    }
+}
+
+// Runs on the watcher thread, so parsing never holds up the main loop
+void ResourceWatcher::LoadChanges(const std::unordered_set<std::string>& changed)
+{
+    ResourceUpdate update;
+    std::vector<std::string> midi_paths;
+
+    for (const std::string& path : changed) {
+        if (path != manifest_path_) {
+            midi_paths.push_back(path);
+            continue;
+        }
+
+        auto entries = ParseExerciseManifest(path);
+        if (entries.is_error()) {
+            tb::print("Couldn't reload '{}': {}\n", path, entries.get_error().What());
+            continue;
+        }
+        update.exercises = std::move(entries.get_mut_unchecked());
+    }
+
+    // A checkout or sync can change many files at once
+    std::vector<LoadedMIDI> midis = LoadMIDIBodies(cache_, midi_paths);
+    for (size_t i = 0; i < midi_paths.size(); ++i)
+        update.midis.emplace_back(std::move(midi_paths[i]), std::move(midis[i]));
+
+    if (!update.exercises && update.midis.empty())
+        return;
+
+    {
+        std::scoped_lock guard(lock_);
+
+        // Merged with an update the main thread hasn't taken yet, newest first
+        if (pending_) {
+            if (!update.exercises)
+                update.exercises = std::move(pending_->exercises);
+
+            for (auto& midi : pending_->midis) {
+                if (!changed.contains(midi.first))
+                    update.midis.push_back(std::move(midi));
+            }
+        }
+
+        pending_ = std::move(update);
+    }
+
+    ResourcesChangedEvent ev {};
+    SDL_PushEvent(reinterpret_cast<SDL_Event*>(&ev));
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "cache.h"
+#include "events.h"
+#include "game.h"
+
+#include <tb/tb.h>
+
+struct WatchError
+{
+    enum Type
+    {
+        INOTIFY_FAILED, EVENTFD_FAILED
+    } type;
+    int errno_value = 0;
+
+    constexpr auto What() const -> std::string_view
+    {
+        switch (type) {
+        case INOTIFY_FAILED: return "could not watch for file changes";
+        case EVENTFD_FAILED: return "could not create event descriptor";
+        default: return "unknown error";
+        }
+    }
+};
+
+// Watches the exercise manifest and the MIDIs it uses through inotify. Files
+// are re-read on a background thread once writes to them have settled, so the
+// main thread only swaps in what is already parsed. Directories are watched
+// rather than files, as editors often save by renaming a new file over the old.
+class ResourceWatcher
+{
+public:
+    ResourceWatcher(std::string manifest_path, MIDICache* cache);
+    ~ResourceWatcher();
+
+    ResourceWatcher(const ResourceWatcher&) = delete;
+    ResourceWatcher& operator=(const ResourceWatcher&) = delete;
+
+    auto Start() -> tb::error<WatchError>;
+    // Replaces the watched MIDIs, keeping the manifest
+    void WatchFiles(std::span<const std::string> paths);
+    auto TakeUpdate() -> std::optional<ResourceUpdate>;
+
+private:
+    void AddWatch(const std::string& path);
+    void Run();
+    void ReadChanges(std::unordered_set<std::string>& changed);
+    void LoadChanges(const std::unordered_set<std::string>& changed);
+
+    std::string manifest_path_;
+    MIDICache* cache_;
+    int inotify_fd_ = -1, stop_fd_ = -1;
+    std::thread thread_;
+
+    std::mutex lock_;
+    std::unordered_map<int, std::string> directories_;     // By watch descriptor
+    std::unordered_set<std::string> files_;
+    std::optional<ResourceUpdate> pending_;
+};
@@ -0,0 +1,70 @@
+// Builds a resource pack from an exercise manifest, the MIDIs it lists and any
+// other files given, such as the cadences:
+//
+//     ./wte-pack exercises.wtepack exercises.txt midis/cadences/*.mid
+//
+// The pack is then given to wte in place of the manifest.
+
+#include "fileio.h"
+#include "game.h"
+#include "pack.h"
+
+#include <tb/tb.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+auto main(int argc, char** argv) -> int
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <pack> <manifest> [files...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    auto entries = ParseExerciseManifest(std::string_view(argv[2]));
+    if (entries.is_error()) {
+        tb::print("Failed to load exercises: {}\n", entries.get_error().What());
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> paths { argv[2] };
+    for (const ExerciseEntry& entry : entries.get_unchecked())
+        paths.push_back(entry.path);
+    paths.insert(paths.end(), argv + 3, argv + argc);
+
+    std::vector<std::string> names;
+    std::unordered_set<std::string> seen;
+    for (const std::string& path : paths) {
+        std::string name = std::filesystem::path(path).lexically_normal();
+        if (seen.insert(name).second)
+            names.push_back(std::move(name));
+    }
+
+    std::vector<fileio::FileContents> contents = fileio::ReadFiles(names);
+    std::vector<pack::File> files = tb::with_capacity(names.size());
+    size_t loose_bytes = 0;
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (contents[i].info.error != 0) {
+            tb::print("Failed to read '{}': {}\n", names[i], strerror(contents[i].info.error));
+            return EXIT_FAILURE;
+        }
+
+        loose_bytes += contents[i].bytes.size();
+        files.push_back({ .name = std::move(names[i]), .bytes = std::move(contents[i].bytes) });
+    }
+
+    if (auto result = pack::WritePack(argv[1], files); result.is_error()) {
+        tb::print("Failed to write '{}': {}\n", argv[1], result.get_error().What());
+        return EXIT_FAILURE;
+    }
+
+    tb::print("Packed {} files, {} bytes into {} bytes\n", files.size(), loose_bytes,
+        std::filesystem::file_size(argv[1]));
+    return 0;
+}